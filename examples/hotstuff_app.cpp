@@ -63,9 +63,19 @@ using hotstuff::MsgRespCmd;
 using hotstuff::get_hash;
 using hotstuff::promise_t;
 
-using HotStuff = hotstuff::HotStuffSecp256k1;
+class HotStuffAppBase {
+    public:
+    virtual ~HotStuffAppBase() = default;
+    virtual void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps, double delta) = 0;
+    virtual void stop() = 0;
+};
+
+/** The replica application, templated by the HotStuff instantiation (i.e. the
+ * cryptographic backend). */
+template<typename HotStuff>
+class HotStuffApp: public HotStuff, public HotStuffAppBase {
+    using Net = typename HotStuff::Net;
 
-class HotStuffApp: public HotStuff {
     double stat_period;
     double impeach_timeout;
     EventContext ec;
@@ -83,12 +93,15 @@ class HotStuffApp: public HotStuff {
     std::unordered_map<const uint256_t, promise_t> unconfirmed;
 
     using conn_t = ClientNetwork<opcode_t>::conn_t;
-    using resp_queue_t = salticidae::MPSCQueueEventDriven<std::pair<Finality, NetAddr>>;
+    using resp_t = std::vector<std::pair<Finality, NetAddr>>;
+    using resp_queue_t = salticidae::MPSCQueueEventDriven<resp_t>;
 
     /* for the dedicated thread sending responses to the clients */
     std::thread req_thread;
     std::thread resp_thread;
     resp_queue_t resp_queue;
+    /** the responses for the block being committed, sent as one batch */
+    resp_t resp_batch;
     salticidae::BoxObj<salticidae::ThreadCall> resp_tcall;
     salticidae::BoxObj<salticidae::ThreadCall> req_tcall;
 
@@ -112,6 +125,21 @@ class HotStuffApp: public HotStuff {
 #endif
     }
 
+    void state_machine_execute_block(const hotstuff::block_t &blk,
+                                    const std::vector<uint256_t> &cmds) override {
+#ifndef HOTSTUFF_ENABLE_BENCHMARK
+        HOTSTUFF_LOG_INFO("replicated %s with %lu cmds",
+                        std::string(*blk).c_str(), cmds.size());
+#endif
+    }
+
+    void on_decide_block(const hotstuff::block_t &) override {
+        reset_imp_timer();
+        if (resp_batch.empty()) return;
+        resp_queue.enqueue(std::move(resp_batch));
+        resp_batch.clear();
+    }
+
 #ifdef SYNCHS_AUTOCLI
     void do_demand_commands(size_t blk_size) override {
         size_t ncli = client_conns.size();
@@ -138,11 +166,11 @@ class HotStuffApp: public HotStuff {
                 hotstuff::pacemaker_bt pmaker,
                 const EventContext &ec,
                 size_t nworker,
-                const Net::Config &repnet_config,
+                const typename Net::Config &repnet_config,
                 const ClientNetwork<opcode_t>::Config &clinet_config);
 
-    void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps, double delta);
-    void stop();
+    void start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps, double delta) override;
+    void stop() override;
 };
 
 std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
@@ -152,7 +180,7 @@ std::pair<std::string, std::string> split_ip_port_cport(const std::string &s) {
     return std::make_pair(ret[0], ret[1]);
 }
 
-salticidae::BoxObj<HotStuffApp> papp = nullptr;
+salticidae::BoxObj<HotStuffAppBase> papp = nullptr;
 
 int main(int argc, char **argv) {
     Config config("hotstuff.conf");
@@ -176,12 +204,33 @@ int main(int argc, char **argv) {
     auto opt_prop_delay = Config::OptValDouble::create(1);
     auto opt_imp_timeout = Config::OptValDouble::create(11);
     auto opt_nworker = Config::OptValInt::create(1);
+    auto opt_worker_cpus = Config::OptValStr::create();
     auto opt_repnworker = Config::OptValInt::create(1);
     auto opt_repburst = Config::OptValInt::create(100);
     auto opt_clinworker = Config::OptValInt::create(8);
     auto opt_cliburst = Config::OptValInt::create(1000);
     auto opt_notls = Config::OptValFlag::create(false);
     auto opt_delta = Config::OptValDouble::create(1);
+    auto opt_crypto = Config::OptValStr::create("secp256k1");
+    auto opt_prune_staleness = Config::OptValInt::create(100);
+    auto opt_prune_interval = Config::OptValInt::create(0);
+    auto opt_blk_cache_budget = Config::OptValInt::create(0);
+    auto opt_prune_batch = Config::OptValInt::create(64);
+    auto opt_fast_quorum = Config::OptValInt::create(0);
+    auto opt_pipeline_depth = Config::OptValInt::create(1);
+    auto opt_exec_queue = Config::OptValInt::create(0);
+    auto opt_blk_size_min = Config::OptValInt::create(0);
+    auto opt_blk_size_max = Config::OptValInt::create(0);
+    auto opt_batch_wait = Config::OptValDouble::create(0);
+    auto opt_adaptive_delta = Config::OptValFlag::create(false);
+    auto opt_compact_proposal = Config::OptValFlag::create(false);
+    auto opt_coalesce_bytes = Config::OptValInt::create(0);
+    auto opt_vote_fanout = Config::OptValInt::create(0);
+    auto opt_vote_agg_wait = Config::OptValDouble::create(-1);
+    auto opt_delta_percentile = Config::OptValDouble::create(0.99);
+    auto opt_delta_factor = Config::OptValDouble::create(2);
+    auto opt_delta_min = Config::OptValDouble::create(-1);
+    auto opt_delta_max = Config::OptValDouble::create(-1);
 
     config.add_opt("block-size", opt_blk_size, Config::SET_VAL);
     config.add_opt("parent-limit", opt_parent_limit, Config::SET_VAL);
@@ -198,12 +247,33 @@ int main(int argc, char **argv) {
     config.add_opt("prop-delay", opt_prop_delay, Config::SET_VAL, 't', "set the delay that follows the timeout for the Round-Robin Pacemaker");
     config.add_opt("imp-timeout", opt_imp_timeout, Config::SET_VAL, 'u', "set impeachment timeout (for sticky)");
     config.add_opt("nworker", opt_nworker, Config::SET_VAL, 'n', "the number of threads for verification");
+    config.add_opt("worker-cpus", opt_worker_cpus, Config::SET_VAL, 'w', "pin verification threads to a comma-separated list of CPUs");
     config.add_opt("repnworker", opt_repnworker, Config::SET_VAL, 'm', "the number of threads for replica network");
     config.add_opt("repburst", opt_repburst, Config::SET_VAL, 'b', "");
     config.add_opt("clinworker", opt_clinworker, Config::SET_VAL, 'M', "the number of threads for client network");
     config.add_opt("cliburst", opt_cliburst, Config::SET_VAL, 'B', "");
     config.add_opt("notls", opt_notls, Config::SWITCH_ON, 's', "disable TLS");
     config.add_opt("delta", opt_delta, Config::SET_VAL, 'd', "maximum network delay");
+    config.add_opt("crypto", opt_crypto, Config::SET_VAL, 'C', "signature scheme (secp256k1, secp256k1-halfagg, ed25519)");
+    config.add_opt("prune-staleness", opt_prune_staleness, Config::SET_VAL, 'S', "the number of committed blocks kept below the last committed one");
+    config.add_opt("prune-interval", opt_prune_interval, Config::SET_VAL, 'P', "prune every this many committed blocks (0 to disable)");
+    config.add_opt("blk-cache-budget", opt_blk_cache_budget, Config::SET_VAL, 'G', "prune when the block cache exceeds this many MiB (0 for no budget)");
+    config.add_opt("prune-batch", opt_prune_batch, Config::SET_VAL, 'R', "the number of blocks pruned per event loop tick");
+    config.add_opt("block-size-min", opt_blk_size_min, Config::SET_VAL, 'y', "the smallest block size for adaptive batching (defaults to block-size)");
+    config.add_opt("block-size-max", opt_blk_size_max, Config::SET_VAL, 'Y', "the largest block size for adaptive batching (defaults to block-size)");
+    config.add_opt("batch-wait", opt_batch_wait, Config::SET_VAL, 'W', "propose a partial block after commands wait this long (0 to disable)");
+    config.add_opt("pipeline-depth", opt_pipeline_depth, Config::SET_VAL, 'k', "the number of proposed blocks allowed to wait for their QCs");
+    config.add_opt("exec-queue", opt_exec_queue, Config::SET_VAL, 'e', "execute committed blocks on a separate thread with a queue of this many blocks (0 to execute inline)");
+    config.add_opt("fast-quorum", opt_fast_quorum, Config::SET_VAL, 'F', "commit without waiting for 2 * delta on this many votes, more than 3/4 of the replicas (0 to disable, -1 for all replicas)");
+    config.add_opt("compact-proposal", opt_compact_proposal, Config::SWITCH_ON, 'K', "send the commands of proposed blocks as short IDs");
+    config.add_opt("coalesce-bytes", opt_coalesce_bytes, Config::SET_VAL, 'O', "pack small messages for the same peer into frames of up to this many bytes (0 to disable)");
+    config.add_opt("vote-fanout", opt_vote_fanout, Config::SET_VAL, 'V', "send votes up a tree of this fanout rooted at the proposer (0 to broadcast, -1 for a star)");
+    config.add_opt("vote-agg-wait", opt_vote_agg_wait, Config::SET_VAL, 'U', "how long a replica waits for the votes of its subtree before sending them up (defaults to delta)");
+    config.add_opt("adaptive-delta", opt_adaptive_delta, Config::SWITCH_ON, 'A', "derive delta from the measured message delays");
+    config.add_opt("delta-percentile", opt_delta_percentile, Config::SET_VAL, 'q', "the percentile of the delays used for adaptive delta");
+    config.add_opt("delta-factor", opt_delta_factor, Config::SET_VAL, 'f', "the safety factor applied to the delay percentile");
+    config.add_opt("delta-min", opt_delta_min, Config::SET_VAL, 'x', "the lower bound of adaptive delta (defaults to half of delta)");
+    config.add_opt("delta-max", opt_delta_max, Config::SET_VAL, 'X', "the upper bound of adaptive delta (defaults to delta)");
     config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
 
     EventContext ec;
@@ -241,13 +311,21 @@ int main(int argc, char **argv) {
     NetAddr plisten_addr{split_ip_port_cport(binding_addr).first};
 
     auto parent_limit = opt_parent_limit->get();
+    if (opt_pipeline_depth->get() < 1)
+        throw HotStuffError("pipeline depth should be at least 1");
+    size_t pipeline_depth = opt_pipeline_depth->get();
+    /* a responsive commit needs more than 3/4 of the votes */
+    if (opt_fast_quorum->get() > 0 &&
+        ((size_t)opt_fast_quorum->get() <= replicas.size() * 3 / 4 ||
+        (size_t)opt_fast_quorum->get() > replicas.size()))
+        throw HotStuffError("fast quorum should be more than 3/4 of the replicas");
     hotstuff::pacemaker_bt pmaker;
     if (opt_pace_maker->get() == "dummy")
-        pmaker = new hotstuff::PaceMakerDummyFixed(opt_fixed_proposer->get(), parent_limit);
+        pmaker = new hotstuff::PaceMakerDummyFixed(opt_fixed_proposer->get(), parent_limit, pipeline_depth);
     else
-        pmaker = new hotstuff::PaceMakerRR(ec, parent_limit, opt_base_timeout->get(), opt_prop_delay->get());
+        pmaker = new hotstuff::PaceMakerRR(ec, parent_limit, opt_base_timeout->get(), opt_prop_delay->get(), pipeline_depth);
 
-    HotStuffApp::Net::Config repnet_config;
+    hotstuff::HotStuffBase::Net::Config repnet_config;
     ClientNetwork<opcode_t>::Config clinet_config;
     if (!opt_tls_privkey->get().empty() && !opt_notls->get())
     {
@@ -268,7 +346,24 @@ int main(int argc, char **argv) {
     clinet_config
         .burst_size(opt_cliburst->get())
         .nworker(opt_clinworker->get());
-    papp = new HotStuffApp(opt_blk_size->get(),
+    std::vector<int> worker_cpus;
+    if (!opt_worker_cpus->get().empty())
+        for (const auto &s: trim_all(split(opt_worker_cpus->get(), ",")))
+        {
+            size_t end;
+            int cpu;
+            try {
+                cpu = std::stoi(s, &end);
+            } catch (std::logic_error &) {
+                throw HotStuffError("invalid cpu in worker-cpus: %s", s.c_str());
+            }
+            if (end != s.size() || cpu < 0 || cpu >= CPU_SETSIZE)
+                throw HotStuffError("invalid cpu in worker-cpus: %s", s.c_str());
+            worker_cpus.push_back(cpu);
+        }
+    auto create_app = [&](auto *hs) -> HotStuffAppBase * {
+        using HotStuff = std::remove_pointer_t<decltype(hs)>;
+        auto app = new HotStuffApp<HotStuff>(opt_blk_size->get(),
                         opt_stat_period->get(),
                         opt_imp_timeout->get(),
                         idx,
@@ -280,6 +375,47 @@ int main(int argc, char **argv) {
                         opt_nworker->get(),
                         repnet_config,
                         clinet_config);
+        app->set_worker_affinity(worker_cpus);
+        app->set_prune_policy(opt_prune_staleness->get(),
+                            opt_prune_interval->get(),
+                            (size_t)opt_blk_cache_budget->get() << 20,
+                            opt_prune_batch->get());
+        if (opt_exec_queue->get() > 0)
+            app->enable_executor(opt_exec_queue->get());
+        app->set_fast_quorum(opt_fast_quorum->get() < 0 ?
+                            replicas.size() : opt_fast_quorum->get());
+        app->set_batching(opt_blk_size_min->get() > 0 ?
+                            opt_blk_size_min->get() : opt_blk_size->get(),
+                        opt_blk_size_max->get() > 0 ?
+                            opt_blk_size_max->get() : opt_blk_size->get(),
+                        opt_batch_wait->get());
+        if (opt_compact_proposal->get())
+            app->enable_compact_proposal();
+        if (opt_coalesce_bytes->get() > 0)
+            app->enable_coalescing(opt_coalesce_bytes->get());
+        if (opt_vote_fanout->get() != 0)
+            app->set_vote_aggregation(opt_vote_fanout->get() < 0 ?
+                                    replicas.size() : opt_vote_fanout->get(),
+                                    opt_vote_agg_wait->get() < 0 ?
+                                    opt_delta->get() : opt_vote_agg_wait->get());
+        if (opt_adaptive_delta->get())
+            app->enable_adaptive_delta(opt_delta_percentile->get(),
+                                    opt_delta_factor->get(),
+                                    opt_delta_min->get() < 0 ?
+                                        opt_delta->get() / 2 : opt_delta_min->get(),
+                                    opt_delta_max->get() < 0 ?
+                                        opt_delta->get() : opt_delta_max->get());
+        return app;
+    };
+    const auto &crypto = opt_crypto->get();
+    if (crypto == "secp256k1")
+        papp = create_app((hotstuff::HotStuffSecp256k1 *)nullptr);
+    else if (crypto == "secp256k1-halfagg")
+        papp = create_app((hotstuff::HotStuffSecp256k1HalfAgg *)nullptr);
+    else if (crypto == "ed25519")
+        papp = create_app((hotstuff::HotStuffEd25519 *)nullptr);
+    else
+        throw HotStuffError("unsupported signature scheme");
     std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> reps;
     for (auto &r: replicas)
     {
@@ -300,7 +436,8 @@ int main(int argc, char **argv) {
     return 0;
 }
 
-HotStuffApp::HotStuffApp(uint32_t blk_size,
+template<typename HotStuff>
+HotStuffApp<HotStuff>::HotStuffApp(uint32_t blk_size,
                         double stat_period,
                         double impeach_timeout,
                         ReplicaID idx,
@@ -310,7 +447,7 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
                         hotstuff::pacemaker_bt pmaker,
                         const EventContext &ec,
                         size_t nworker,
-                        const Net::Config &repnet_config,
+                        const typename Net::Config &repnet_config,
                         const ClientNetwork<opcode_t>::Config &clinet_config):
     HotStuff(blk_size, idx, raw_privkey,
             plisten_addr, std::move(pmaker), ec, nworker, repnet_config),
@@ -323,15 +460,16 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
     resp_tcall = new salticidae::ThreadCall(resp_ec);
     req_tcall = new salticidae::ThreadCall(req_ec);
     resp_queue.reg_handler(resp_ec, [this](resp_queue_t &q) {
-        std::pair<Finality, NetAddr> p;
-        while (q.try_dequeue(p))
-        {
-            try {
-                cn.send_msg(MsgRespCmd(std::move(p.first)), p.second);
-            } catch (std::exception &err) {
-                HOTSTUFF_LOG_WARN("unable to send to the client: %s", err.what());
+        resp_t resps;
+        while (q.try_dequeue(resps))
+            for (auto &p: resps)
+            {
+                try {
+                    cn.send_msg(MsgRespCmd(std::move(p.first)), p.second);
+                } catch (std::exception &err) {
+                    HOTSTUFF_LOG_WARN("unable to send to the client: %s", err.what());
+                }
             }
-        }
         return false;
     });
 
@@ -341,33 +479,38 @@ HotStuffApp::HotStuffApp(uint32_t blk_size,
     cn.listen(clisten_addr);
 }
 
-void HotStuffApp::client_request_cmd_handler(MsgReqCmd &&msg, const conn_t &conn) {
+template<typename HotStuff>
+void HotStuffApp<HotStuff>::client_request_cmd_handler(MsgReqCmd &&msg, const conn_t &conn) {
     const NetAddr addr = conn->get_addr();
     auto cmd = parse_cmd(msg.serialized);
     const auto &cmd_hash = cmd->get_hash();
     HOTSTUFF_LOG_DEBUG("processing %s", std::string(*cmd).c_str());
-    exec_command(cmd_hash, [this, addr](Finality fin) {
-        resp_queue.enqueue(std::make_pair(fin, addr));
+    this->exec_command(cmd_hash, [this, addr](Finality fin) {
+        /* committed ones are flushed by on_decide_block() */
+        if (fin.decision == 1)
+            resp_batch.push_back(std::make_pair(fin, addr));
+        else
+            resp_queue.enqueue(resp_t{std::make_pair(fin, addr)});
     });
 }
 
-void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps,
+template<typename HotStuff>
+void HotStuffApp<HotStuff>::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytearray_t>> &reps,
                         double delta) {
     ev_stat_timer = TimerEvent(ec, [this](TimerEvent &) {
         HotStuff::print_stat();
         HotStuffApp::print_stat();
-        //HotStuffCore::prune(100);
         ev_stat_timer.add(stat_period);
     });
     ev_stat_timer.add(stat_period);
     impeach_timer = TimerEvent(ec, [this](TimerEvent &) {
-        if (get_decision_waiting().size())
-            get_pace_maker()->impeach();
+        if (this->get_decision_waiting().size())
+            this->get_pace_maker()->impeach();
         reset_imp_timer();
     });
     impeach_timer.add(impeach_timeout);
     HOTSTUFF_LOG_INFO("** starting the system with parameters **");
-    HOTSTUFF_LOG_INFO("blk_size = %lu", blk_size);
+    HOTSTUFF_LOG_INFO("blk_size = %lu", this->blk_size);
     HOTSTUFF_LOG_INFO("conns = %lu", HotStuff::size());
     HOTSTUFF_LOG_INFO("delta = %.4f", delta);
     HOTSTUFF_LOG_INFO("** starting the event loop...");
@@ -386,11 +529,12 @@ void HotStuffApp::start(const std::vector<std::tuple<NetAddr, bytearray_t, bytea
     ec.dispatch();
 }
 
-void HotStuffApp::stop() {
-    papp->req_tcall->async_call([this](salticidae::ThreadCall::Handle &) {
+template<typename HotStuff>
+void HotStuffApp<HotStuff>::stop() {
+    req_tcall->async_call([this](salticidae::ThreadCall::Handle &) {
         req_ec.stop();
     });
-    papp->resp_tcall->async_call([this](salticidae::ThreadCall::Handle &) {
+    resp_tcall->async_call([this](salticidae::ThreadCall::Handle &) {
         resp_ec.stop();
     });
 
@@ -399,7 +543,8 @@ void HotStuffApp::stop() {
     ec.stop();
 }
 
-void HotStuffApp::print_stat() const {
+template<typename HotStuff>
+void HotStuffApp<HotStuff>::print_stat() const {
 #ifdef HOTSTUFF_MSG_STAT
     HOTSTUFF_LOG_INFO("--- client msg. (10s) ---");
     size_t _nsent = 0;
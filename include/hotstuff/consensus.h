@@ -19,7 +19,10 @@
 #define _HOTSTUFF_CONSENSUS_H
 
 #include <cassert>
+#include <map>
+#include <deque>
 #include <set>
+#include <stack>
 #include <unordered_map>
 
 #include "hotstuff/promise.hpp"
@@ -38,6 +41,20 @@ struct Finality;
 
 /** Abstraction for HotStuff protocol state machine (without network implementation). */
 class HotStuffCore {
+    /** Per-height bookkeeping, dropped once the height falls below b_exec. */
+    struct HeightState {
+        /** proposals seen at this height (only valid for the current view) */
+        std::unordered_set<block_t> proposals;
+        /** blocks whose proposal has been handled */
+        std::unordered_set<block_t> finished_propose;
+        /** promises waiting for the QC of a block */
+        std::unordered_map<block_t, promise_t> qc_waiting;
+        /** blocks voted for by this replica in the current view */
+        std::unordered_set<block_t> self_voted;
+        /** blocks whose QC this replica holds */
+        std::unordered_set<block_t> qc_held;
+    };
+
     block_t b0;                                  /** the genesis block */
     /* === state variables === */
     /** block containing the QC for the highest block having one */
@@ -50,8 +67,7 @@ class HotStuffCore {
     /* === only valid for the current view === */
     bool progress; /**< whether heard a proposal in the current view: this->view */
     bool view_trans; /**< whether the replica is in-between the views */
-    std::unordered_map<uint32_t, std::unordered_set<block_t>> proposals;
-    std::unordered_map<block_t, bool> finished_propose;
+    std::map<uint32_t, HeightState> height_state;
     quorum_cert_bt blame_qc;
     std::unordered_set<ReplicaID> blamed;
 
@@ -60,22 +76,39 @@ class HotStuffCore {
     std::set<block_t, BlockHeightCmp> tails;   /**< set of tail blocks */
     ReplicaConfig config;                   /**< replica configuration */
     /* === async event queues === */
-    std::unordered_map<block_t, promise_t> qc_waiting;
     promise_t propose_waiting;
     promise_t receive_proposal_waiting;
     promise_t hqc_update_waiting;
     promise_t view_change_waiting;
     promise_t view_trans_waiting;
+    /* === incremental pruning === */
+    /** the number of prunings that retry a block still referenced elsewhere */
+    static const uint8_t prune_max_retry = 8;
+    /** blocks being detached from their parents, see prune_step() */
+    std::stack<block_t> prune_stack;
+    /** blocks that could not be released yet, with the attempts left */
+    std::deque<std::pair<block_t, uint8_t>> prune_deferred;
+    /** height of the lowest block kept by the last pruning */
+    uint32_t pruned_height;
     /* == feature switches == */
     /** always vote negatively, useful for some PaceMakers */
     bool vote_disabled;
+    /** start the commit wait of a block upon its QC, see set_commit_on_qc() */
+    bool commit_on_qc;
 
     block_t get_delivered_blk(const uint256_t &blk_hash);
     void sanity_check_delivered(const block_t &blk);
     void check_commit(const block_t &_hqc);
     void update_hqc(const block_t &_hqc, const quorum_cert_bt &qc);
+    /** Handle a QC for blk, however it was learned. */
+    void on_receive_qc(const block_t &blk, const quorum_cert_bt &qc);
+    bool is_finished_propose(const block_t &blk) const;
+    /** Drop the bookkeeping for all heights lower than `height`. */
+    void truncate_height_state(uint32_t height);
     void on_hqc_update();
     void on_qc_finish(const block_t &blk);
+    void on_fast_quorum(const block_t &blk);
+    void fast_commit(const block_t &blk);
     void on_propose_(const Proposal &prop);
     void on_receive_proposal_(const Proposal &prop);
     void on_view_change();
@@ -86,6 +119,8 @@ class HotStuffCore {
 
     protected:
     ReplicaID id;                  /**< identity of the replica itself */
+    /** Update delta, taking effect from the next timer being set. */
+    void set_delta(double delta) { config.delta = delta; }
 
     public:
     BoxObj<EntityStorage> storage;
@@ -102,6 +137,14 @@ class HotStuffCore {
      * functions. */
     void on_init(uint32_t nfaulty, double delta);
 
+    /** Enable the fast-commit path: a block is committed right away, instead
+     * of when its commit timer fires, once both the block and its successor
+     * have votes from `nfast` replicas. Such a commit is only safe with more
+     * than 3/4 of the replicas, so the value is clamped to [floor(3n/4) + 1,
+     * n] by on_init(), 0 disables the path. It relies on votes being
+     * broadcast to all replicas. */
+    void set_fast_quorum(size_t nfast) { config.nfast = nfast; }
+
     /* TODO: better name for "delivery" ? */
     /** Call to inform the state machine that a block is ready to be handled.
      * A block is only delivered if itself is fetched, the block for the
@@ -122,6 +165,8 @@ class HotStuffCore {
     void on_receive_blame(const Blame &blame);
     void on_receive_blamenotify(const BlameNotify &blame);
     void on_commit_timeout(const block_t &blk);
+    /** Handle several commit timeouts at once. */
+    void on_commit_timeout(std::vector<block_t> &blks);
     void on_blame_timeout();
     void on_viewtrans_timeout();
 
@@ -141,6 +186,9 @@ class HotStuffCore {
     protected:
     /** Called by HotStuffCore upon the decision being made for cmd. */
     virtual void do_decide(Finality &&fin) = 0;
+    /** Called by HotStuffCore upon committing a block. By default, it calls
+     * do_decide() for each command in the block. */
+    virtual void do_decide_block(const block_t &blk);
     virtual void do_consensus(const block_t &blk) = 0;
     /** Called by HotStuffCore upon broadcasting a new proposal.
      * The user should send the proposal message to all replicas except for
@@ -150,6 +198,10 @@ class HotStuffCore {
     virtual void do_broadcast_blame(const Blame &blame) = 0;
     virtual void do_broadcast_blamenotify(const BlameNotify &bn) = 0;
     virtual void do_notify(const Notify &notify) = 0;
+    /** Called by HotStuffCore, with commit_on_qc set, the first time it
+     * holds the QC of a block. The user should send the notification to
+     * all replicas except for itself. */
+    virtual void do_broadcast_qc(const Notify &) {}
     virtual void set_commit_timer(const block_t &blk, double t_sec) = 0;
     virtual void set_blame_timer(double t_sec) = 0;
     virtual void stop_commit_timer(uint32_t height) = 0;
@@ -163,6 +215,12 @@ class HotStuffCore {
     public:
     /** Create a partial certificate that proves the vote for a block. */
     virtual part_cert_bt create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) = 0;
+    /** Get a promise resolved (with part_cert_t cert) when the partial
+     * certificate is created. By default, it is created in place. */
+    virtual promise_t async_create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) {
+        part_cert_t cert = create_part_cert(priv_key, blk_hash);
+        return promise_t([cert](promise_t &pm) { pm.resolve(cert); });
+    }
     /** Create a partial certificate from its seralized form. */
     virtual part_cert_bt parse_part_cert(DataStream &s) = 0;
     /** Create a quorum certificate that proves 2f+1 votes for a block. */
@@ -178,10 +236,22 @@ class HotStuffCore {
     void add_replica(ReplicaID rid, const NetAddr &addr, pubkey_bt &&pub_key);
     /** Try to prune blocks lower than last committed height - staleness. */
     void prune(uint32_t staleness);
+    /** Start an incremental pruning of the blocks lower than last committed
+     * height - staleness, which is then carried out by prune_step().
+     * @param top the block to count `staleness` down from instead of the last
+     * committed one, e.g. the last one a separate thread is done with
+     * @return false if there is nothing to prune or a pruning is ongoing */
+    bool prune_begin(uint32_t staleness, const block_t &top = nullptr);
+    /** Handle at most `quota` blocks of the ongoing pruning.
+     * @return true if there is more work left */
+    bool prune_step(size_t quota);
+    bool is_pruning() const { return !prune_stack.empty(); }
+    uint32_t get_pruned_height() const { return pruned_height; }
 
     /* PaceMaker can use these functions to monitor the core protocol state
      * transition */
-    /** Get a promise resolved when the block gets a QC. */
+    /** Get a promise resolved when the block gets a QC, or once it is at or
+     * below b_exec. */
     promise_t async_qc_finish(const block_t &blk);
     /** Get a promise resolved when a new block is proposed. */
     promise_t async_wait_proposal();
@@ -197,12 +267,19 @@ class HotStuffCore {
     /* Other useful functions */
     const block_t &get_genesis() { return b0; }
     const block_t &get_hqc() { return hqc.first; }
-    const ReplicaConfig &get_config() { return config; }
+    uint32_t get_exec_height() const { return b_exec->get_height(); }
+    const ReplicaConfig &get_config() const { return config; }
     ReplicaID get_id() const { return id; }
     const std::set<block_t, BlockHeightCmp> get_tails() const { return tails; }
     uint32_t get_view() const { return view; }
     operator std::string () const;
     void set_vote_disabled(bool f) { vote_disabled = f; }
+    /** Start the 2 * delta commit wait of a block once this replica both
+     * voted for it and holds its QC, instead of upon the vote, and relay each
+     * QC to everyone the first time it is seen. This is needed when the
+     * votes are not broadcast: a block is then only committed after every
+     * honest replica can hold its QC. */
+    void set_commit_on_qc(bool f) { commit_on_qc = f; }
 };
 
 
@@ -314,6 +391,90 @@ struct Vote: public Serializable {
     }
 };
 
+/** A batch of votes for the same block, sent up the vote aggregation tree
+ * by a replica on behalf of its subtree. */
+struct VoteBundle: public Serializable {
+    /** block being voted */
+    uint256_t blk_hash;
+    /** the voters with their proofs */
+    std::vector<std::pair<ReplicaID, part_cert_bt>> votes;
+
+    /** handle of the core object to allow polymorphism */
+    HotStuffCore *hsc;
+
+    VoteBundle(): hsc(nullptr) {}
+    VoteBundle(const uint256_t &blk_hash, HotStuffCore *hsc):
+        blk_hash(blk_hash), hsc(hsc) {}
+
+    VoteBundle(const VoteBundle &other):
+        blk_hash(other.blk_hash), hsc(other.hsc) {
+        for (const auto &v: other.votes)
+            votes.push_back(std::make_pair(v.first, part_cert_bt(v.second->clone())));
+    }
+
+    VoteBundle(VoteBundle &&other) = default;
+
+    void add(ReplicaID voter, const PartCert &cert) {
+        votes.push_back(std::make_pair(voter, part_cert_bt(cert.clone())));
+    }
+
+    void add(const Vote &vote) { add(vote.voter, *vote.cert); }
+
+    Vote get_vote(size_t i) const {
+        return Vote(votes[i].first, blk_hash,
+                    part_cert_bt(votes[i].second->clone()), hsc);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << blk_hash << htole((uint32_t)votes.size());
+        for (const auto &v: votes)
+            s << v.first << *v.second;
+    }
+
+    void unserialize(DataStream &s) override {
+        assert(hsc != nullptr);
+        uint32_t n;
+        s >> blk_hash >> n;
+        n = letoh(n);
+        if (n == 0 || n > hsc->get_config().nreplicas)
+            throw std::invalid_argument("ill-formed vote bundle");
+        votes.clear();
+        for (uint32_t i = 0; i < n; i++)
+        {
+            ReplicaID voter;
+            s >> voter;
+            votes.push_back(std::make_pair(voter, hsc->parse_part_cert(s)));
+        }
+    }
+
+    /** Check all the votes as one batch; the bundle is rejected as a whole
+     * if any of them is bad. */
+    promise_t verify(VeriPool &vpool) const {
+        assert(hsc != nullptr);
+        const auto &config = hsc->get_config();
+        auto obj_hash = Vote::proof_obj_hash(blk_hash);
+        auto qc = hsc->create_quorum_cert(obj_hash);
+        std::vector<bool> seen(config.nreplicas);
+        for (const auto &v: votes)
+        {
+            if (v.first >= config.nreplicas || seen[v.first] ||
+                v.second->get_obj_hash() != obj_hash)
+                return promise_t([](promise_t &pm) { pm.resolve(false); });
+            seen[v.first] = true;
+            qc->add_part(v.first, *v.second);
+        }
+        return qc->verify_parts(config, vpool);
+    }
+
+    operator std::string () const {
+        DataStream s;
+        s << "<vote-bundle "
+          << "blk=" << get_hex10(blk_hash) << " "
+          << "nvotes=" << std::to_string(votes.size()) << ">";
+        return std::move(s);
+    }
+};
+
 struct Notify: public Serializable {
     uint256_t blk_hash;
     quorum_cert_bt qc;
@@ -345,15 +506,15 @@ struct Notify: public Serializable {
 
     bool verify() const {
         assert(hsc != nullptr);
-        return qc->verify(hsc->get_config()) &&
-            qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash);
+        return qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash) &&
+            hsc->storage->verify_qc(*qc, hsc->get_config());
     }
 
     promise_t verify(VeriPool &vpool) const {
         assert(hsc != nullptr);
-        return qc->verify(hsc->get_config(), vpool).then([this](bool result) {
-            return result && qc->get_obj_hash() == Vote::proof_obj_hash(blk_hash);
-        });
+        if (qc->get_obj_hash() != Vote::proof_obj_hash(blk_hash))
+            return promise_t([](promise_t &pm) { pm.resolve(false); });
+        return hsc->storage->verify_qc(*qc, hsc->get_config(), vpool);
     }
 
     operator std::string () const {
@@ -467,9 +628,9 @@ struct BlameNotify: public Serializable {
 
     bool verify() const {
         assert(hsc != nullptr);
-        return qc->verify(hsc->get_config()) &&
-            qc->get_obj_hash() == Blame::proof_obj_hash(view) &&
-            hqc_qc->get_obj_hash() == Vote::proof_obj_hash(hqc_hash);
+        return qc->get_obj_hash() == Blame::proof_obj_hash(view) &&
+            hqc_qc->get_obj_hash() == Vote::proof_obj_hash(hqc_hash) &&
+            hsc->storage->verify_qc(*qc, hsc->get_config());
     }
 
     promise_t verify(VeriPool &vpool) const {
@@ -478,8 +639,8 @@ struct BlameNotify: public Serializable {
             hqc_qc->get_obj_hash() != Vote::proof_obj_hash(hqc_hash))
             return promise_t([](promise_t &){ return false; });
         return promise::all(std::vector<promise_t>{
-            qc->verify(hsc->get_config(), vpool),
-            hqc_qc->verify(hsc->get_config(), vpool),
+            hsc->storage->verify_qc(*qc, hsc->get_config(), vpool),
+            hsc->storage->verify_qc(*hqc_qc, hsc->get_config(), vpool),
         }).then([](const promise::values_t &values) {
             return promise::any_cast<bool>(values[0]) &&
                 promise::any_cast<bool>(values[1]);
@@ -497,9 +658,10 @@ struct BlameNotify: public Serializable {
 inline void Proposal::unserialize(DataStream &s) {
     assert(hsc != nullptr);
     s >> proposer;
-    Block _blk;
-    _blk.unserialize(s, hsc);
-    blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+    /* parse in place instead of moving a temporary into the storage */
+    block_t _blk = new Block();
+    _blk->unserialize(s, hsc);
+    blk = hsc->storage->add_blk(_blk);
 }
 
 struct Finality: public Serializable {
@@ -17,7 +17,13 @@
 #ifndef _HOTSTUFF_CRYPTO_H
 #define _HOTSTUFF_CRYPTO_H
 
+#include <atomic>
+#include <memory>
+#include <mutex>
+#include <queue>
+#include <unordered_map>
 #include <openssl/rand.h>
+#include <openssl/evp.h>
 
 #include "secp256k1.h"
 #include "salticidae/crypto.h"
@@ -48,6 +54,8 @@ using privkey_bt = BoxObj<PrivKey>;
 class PartCert: public Serializable, public Cloneable {
     public:
     virtual ~PartCert() = default;
+    /** Verify on the pool; `pubkey` is referenced by the task, so it should
+     * be the one kept in ReplicaConfig. */
     virtual promise_t verify(const PubKey &pubkey, VeriPool &vpool) = 0;
     virtual bool verify(const PubKey &pubkey) = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
@@ -63,11 +71,16 @@ class QuorumCert: public Serializable, public Cloneable {
     virtual void compute() = 0;
     virtual promise_t verify(const ReplicaConfig &config, VeriPool &vpool) = 0;
     virtual bool verify(const ReplicaConfig &config) = 0;
+    /** Verify the partial certificates added so far as one batch, with no
+     * quorum required and before compute(); used to check a bundle of votes
+     * at once. */
+    virtual promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) = 0;
     virtual const uint256_t &get_obj_hash() const = 0;
     virtual QuorumCert *clone() override = 0;
 };
 
 using part_cert_bt = BoxObj<PartCert>;
+using part_cert_t = ArcObj<PartCert>;
 using quorum_cert_bt = BoxObj<QuorumCert>;
 
 class PubKeyDummy: public PubKey {
@@ -137,64 +150,118 @@ class QuorumCertDummy: public QuorumCert {
     promise_t verify(const ReplicaConfig &, VeriPool &) override {
         return promise_t([](promise_t &pm) { pm.resolve(true); });
     }
+    promise_t verify_parts(const ReplicaConfig &, VeriPool &) override {
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    }
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 };
 
+/** Task that signs on a VeriPool worker instead of the event loop; its
+ * promise resolves to the created certificate (part_cert_t). It should be
+ * submitted with VeriPool::verify_urgent(). */
+template<typename PartCertType, typename PrivKeyType>
+class SignTask: public VeriTask {
+    const PrivKeyType &priv_key;
+    uint256_t obj_hash;
+    part_cert_bt cert;
+    public:
+    SignTask(const PrivKeyType &priv_key, const uint256_t &obj_hash):
+        priv_key(priv_key), obj_hash(obj_hash) {}
+    virtual ~SignTask() = default;
+
+    bool verify() override {
+        cert = new PartCertType(priv_key, obj_hash);
+        return true;
+    }
+
+    void settle(promise_t &pm) override {
+        pm.resolve(part_cert_t(std::move(cert)));
+    }
+};
+
+
+/** A bounded set of recently verified signatures, shared by the event loop
+ * and the verifier threads. Each entry is a digest binding the signer, the
+ * signed object and the signature, so a hit means exactly this signature has
+ * already passed verification. */
+class VerifiedSigCache {
+    static const size_t nshard = 16;
+    struct Shard {
+        std::mutex lock;
+        std::unordered_map<uint256_t, uint256_t> entries;
+        std::queue<uint256_t> fifo;  /**< eviction order */
+    };
+    const size_t shard_capacity;
+    Shard shards[nshard];
+    std::atomic<uint64_t> nhit;
+    std::atomic<uint64_t> nmiss;
+
+    Shard &get_shard(const uint256_t &key) {
+        return shards[std::hash<uint256_t>()(key) % nshard];
+    }
+
+    public:
+    VerifiedSigCache(size_t capacity = 16384):
+        shard_capacity((capacity + nshard - 1) / nshard),
+        nhit(0), nmiss(0) {}
+
+    VerifiedSigCache(const VerifiedSigCache &) = delete;
+
+    /** Check whether the signature identified by `key` is known to be valid;
+     * the value stored along with it (if any) is copied to `value`. */
+    bool lookup(const uint256_t &key, uint256_t *value = nullptr);
+    /** Remember that the signature identified by `key` is valid. */
+    void insert(const uint256_t &key, const uint256_t &value = uint256_t());
+
+    uint64_t get_nhit() const { return nhit.load(std::memory_order_relaxed); }
+    uint64_t get_nmiss() const { return nmiss.load(std::memory_order_relaxed); }
+};
+
+extern VerifiedSigCache verified_sig_cache;
 
 class Secp256k1Context {
     secp256k1_context *ctx;
-    friend class PubKeySecp256k1;
-    friend class SigSecp256k1;
     public:
-    Secp256k1Context(bool sign = false):
+    Secp256k1Context():
         ctx(secp256k1_context_create(
-            sign ? SECP256K1_CONTEXT_SIGN :
-                    SECP256K1_CONTEXT_VERIFY)) {}
+            SECP256K1_CONTEXT_SIGN | SECP256K1_CONTEXT_VERIFY)) {}
 
     Secp256k1Context(const Secp256k1Context &) = delete;
 
-    Secp256k1Context(Secp256k1Context &&other): ctx(other.ctx) {
-        other.ctx = nullptr;
-    }
-
     ~Secp256k1Context() {
         if (ctx) secp256k1_context_destroy(ctx);
     }
-};
 
-using secp256k1_context_t = ArcObj<Secp256k1Context>;
-
-extern secp256k1_context_t secp256k1_default_sign_ctx;
-extern secp256k1_context_t secp256k1_default_verify_ctx;
+    /** Get the context of the calling thread. Threads never share a context,
+     * so parsing, signing and verifying need no synchronization at all. */
+    static const secp256k1_context *get() {
+        static thread_local Secp256k1Context tctx;
+        return tctx.ctx;
+    }
+};
 
 class PrivKeySecp256k1;
 
 class PubKeySecp256k1: public PubKey {
     static const auto _olen = 33;
     friend class SigSecp256k1;
+    friend class SigSchnorrSecp256k1;
     secp256k1_pubkey data;
-    secp256k1_context_t ctx;
 
     public:
-    PubKeySecp256k1(const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PubKey(), ctx(ctx) {}
-    
-    PubKeySecp256k1(const bytearray_t &raw_bytes,
-                    const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PubKeySecp256k1(ctx) { from_bytes(raw_bytes); }
-
-    inline PubKeySecp256k1(const PrivKeySecp256k1 &priv_key,
-                            const secp256k1_context_t &ctx =
-                                    secp256k1_default_sign_ctx);
+    PubKeySecp256k1(): PubKey() {}
+
+    PubKeySecp256k1(const bytearray_t &raw_bytes):
+        PubKeySecp256k1() { from_bytes(raw_bytes); }
+
+    inline PubKeySecp256k1(const PrivKeySecp256k1 &priv_key);
 
     void serialize(DataStream &s) const override {
-        static uint8_t output[_olen];
+        uint8_t output[_olen];
         size_t olen = _olen;
         (void)secp256k1_ec_pubkey_serialize(
-                ctx->ctx, (unsigned char *)output,
+                Secp256k1Context::get(), (unsigned char *)output,
                 &olen, &data, SECP256K1_EC_COMPRESSED);
         s.put_data(output, output + _olen);
     }
@@ -203,7 +270,7 @@ class PubKeySecp256k1: public PubKey {
         static const auto _exc = std::invalid_argument("ill-formed public key");
         try {
             if (!secp256k1_ec_pubkey_parse(
-                    ctx->ctx, &data, s.get_data_inplace(_olen), _olen))
+                    Secp256k1Context::get(), &data, s.get_data_inplace(_olen), _olen))
                 throw _exc;
         } catch (std::ios_base::failure &) {
             throw _exc;
@@ -219,18 +286,14 @@ class PrivKeySecp256k1: public PrivKey {
     static const auto nbytes = 32;
     friend class PubKeySecp256k1;
     friend class SigSecp256k1;
+    friend class SigSchnorrSecp256k1;
     uint8_t data[nbytes];
-    secp256k1_context_t ctx;
 
     public:
-    PrivKeySecp256k1(const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PrivKey(), ctx(ctx) {}
+    PrivKeySecp256k1(): PrivKey() {}
 
-    PrivKeySecp256k1(const bytearray_t &raw_bytes,
-                     const secp256k1_context_t &ctx =
-                            secp256k1_default_sign_ctx):
-        PrivKeySecp256k1(ctx) { from_bytes(raw_bytes); }
+    PrivKeySecp256k1(const bytearray_t &raw_bytes):
+        PrivKeySecp256k1() { from_bytes(raw_bytes); }
 
     void serialize(DataStream &s) const override {
         s.put_data(data, data + nbytes);
@@ -254,19 +317,16 @@ class PrivKeySecp256k1: public PrivKey {
 };
 
 pubkey_bt PrivKeySecp256k1::get_pubkey() const {
-    return new PubKeySecp256k1(*this, ctx);
+    return new PubKeySecp256k1(*this);
 }
 
-PubKeySecp256k1::PubKeySecp256k1(
-        const PrivKeySecp256k1 &priv_key,
-        const secp256k1_context_t &ctx): PubKey(), ctx(ctx) {
-    if (!secp256k1_ec_pubkey_create(ctx->ctx, &data, priv_key.data))
+PubKeySecp256k1::PubKeySecp256k1(const PrivKeySecp256k1 &priv_key): PubKey() {
+    if (!secp256k1_ec_pubkey_create(Secp256k1Context::get(), &data, priv_key.data))
         throw std::invalid_argument("invalid secp256k1 private key");
 }
 
 class SigSecp256k1: public Serializable {
     secp256k1_ecdsa_signature data;
-    secp256k1_context_t ctx;
 
     static void check_msg_length(const bytearray_t &msg) {
         if (msg.size() != 32)
@@ -274,21 +334,17 @@ class SigSecp256k1: public Serializable {
     }
 
     public:
-    SigSecp256k1(const secp256k1_context_t &ctx =
-                        secp256k1_default_sign_ctx):
-        Serializable(), ctx(ctx) {}
+    SigSecp256k1(): Serializable() {}
     SigSecp256k1(const uint256_t &digest,
-                const PrivKeySecp256k1 &priv_key,
-                secp256k1_context_t &ctx =
-                        secp256k1_default_sign_ctx):
-        Serializable(), ctx(ctx) {
+                const PrivKeySecp256k1 &priv_key):
+        Serializable() {
         sign(digest, priv_key);
     }
 
     void serialize(DataStream &s) const override {
-        static uint8_t output[64];
+        uint8_t output[64];
         (void)secp256k1_ecdsa_signature_serialize_compact(
-            ctx->ctx, (unsigned char *)output,
+            Secp256k1Context::get(), (unsigned char *)output,
             &data);
         s.put_data(output, output + 64);
     }
@@ -297,7 +353,7 @@ class SigSecp256k1: public Serializable {
         static const auto _exc = std::invalid_argument("ill-formed signature");
         try {
             if (!secp256k1_ecdsa_signature_parse_compact(
-                    ctx->ctx, &data, s.get_data_inplace(64)))
+                    Secp256k1Context::get(), &data, s.get_data_inplace(64)))
                 throw _exc;
         } catch (std::ios_base::failure &) {
             throw _exc;
@@ -307,7 +363,7 @@ class SigSecp256k1: public Serializable {
     void sign(const bytearray_t &msg, const PrivKeySecp256k1 &priv_key) {
         check_msg_length(msg);
         if (!secp256k1_ecdsa_sign(
-                ctx->ctx, &data,
+                Secp256k1Context::get(), &data,
                 (unsigned char *)&*msg.begin(),
                 (unsigned char *)priv_key.data,
                 NULL, // default nonce function
@@ -315,33 +371,78 @@ class SigSecp256k1: public Serializable {
             throw std::invalid_argument("failed to create secp256k1 signature");
     }
 
-    bool verify(const bytearray_t &msg, const PubKeySecp256k1 &pub_key,
-                const secp256k1_context_t &_ctx) const {
+    bool verify(const bytearray_t &msg, const PubKeySecp256k1 &pub_key) const {
         check_msg_length(msg);
         return secp256k1_ecdsa_verify(
-                _ctx->ctx, &data,
+                Secp256k1Context::get(), &data,
                 (unsigned char *)&*msg.begin(),
                 &pub_key.data) == 1;
     }
 
-    bool verify(const bytearray_t &msg, const PubKeySecp256k1 &pub_key) {
-        return verify(msg, pub_key, ctx);
+    /** Get the key identifying (signer, msg, signature) in verified_sig_cache. */
+    uint256_t get_cache_key(const uint256_t &msg, const PubKeySecp256k1 &pub_key) const {
+        DataStream s;
+        s.put_data(pub_key.data.data, pub_key.data.data + sizeof(pub_key.data.data));
+        s << msg;
+        s.put_data(data.data, data.data + sizeof(data.data));
+        return s.get_hash();
     }
+
+    bool is_cached(const uint256_t &key) const { return verified_sig_cache.lookup(key); }
 };
 
 class Secp256k1VeriTask: public VeriTask {
     uint256_t msg;
-    PubKeySecp256k1 pubkey;
+    const PubKeySecp256k1 &pubkey;  /**< owned by ReplicaConfig */
     SigSecp256k1 sig;
+    uint256_t cache_key;
     public:
     Secp256k1VeriTask(const uint256_t &msg,
                         const PubKeySecp256k1 &pubkey,
-                        const SigSecp256k1 &sig):
-        msg(msg), pubkey(pubkey), sig(sig) {}
+                        const SigSecp256k1 &sig,
+                        const uint256_t &cache_key):
+        msg(msg), pubkey(pubkey), sig(sig), cache_key(cache_key) {}
     virtual ~Secp256k1VeriTask() = default;
 
     bool verify() override {
-        return sig.verify(msg, pubkey, secp256k1_default_verify_ctx);
+        if (!sig.verify(msg, pubkey))
+            return false;
+        verified_sig_cache.insert(cache_key);
+        return true;
+    }
+};
+
+/** Verification task that checks a batch of signatures on the same message in
+ * one go, so a quorum certificate costs a single trip through the VeriPool. */
+class Secp256k1QuorumVeriTask: public VeriTask {
+    struct Entry {
+        const PubKeySecp256k1 *pubkey;  /**< owned by ReplicaConfig */
+        SigSecp256k1 sig;
+        uint256_t cache_key;
+    };
+    uint256_t msg;
+    std::vector<Entry> sigs;
+    public:
+    Secp256k1QuorumVeriTask(const uint256_t &msg): msg(msg) {}
+    virtual ~Secp256k1QuorumVeriTask() = default;
+
+    void reserve(size_t n) { sigs.reserve(n); }
+
+    void add(const PubKeySecp256k1 &pubkey, const SigSecp256k1 &sig,
+            const uint256_t &cache_key) {
+        sigs.push_back(Entry{&pubkey, sig, cache_key});
+    }
+
+    size_t size() const { return sigs.size(); }
+
+    bool verify() override {
+        for (const auto &e: sigs)
+        {
+            if (!e.sig.verify(msg, *e.pubkey))
+                return false;
+            verified_sig_cache.insert(e.cache_key);
+        }
+        return true;
     }
 };
 
@@ -356,15 +457,22 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
         obj_hash(obj_hash) {}
 
     bool verify(const PubKey &pub_key) override {
-        return SigSecp256k1::verify(obj_hash,
-                                    static_cast<const PubKeySecp256k1 &>(pub_key),
-                                    secp256k1_default_verify_ctx);
+        const auto &pk = static_cast<const PubKeySecp256k1 &>(pub_key);
+        auto key = get_cache_key(obj_hash, pk);
+        if (verified_sig_cache.lookup(key)) return true;
+        if (!SigSecp256k1::verify(obj_hash, pk))
+            return false;
+        verified_sig_cache.insert(key);
+        return true;
     }
 
     promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
-        return vpool.verify(new Secp256k1VeriTask(obj_hash,
-                static_cast<const PubKeySecp256k1 &>(pub_key),
-                static_cast<const SigSecp256k1 &>(*this)));
+        const auto &pk = static_cast<const PubKeySecp256k1 &>(pub_key);
+        auto key = get_cache_key(obj_hash, pk);
+        if (verified_sig_cache.lookup(key))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        return vpool.verify(new Secp256k1VeriTask(obj_hash, pk,
+                static_cast<const SigSecp256k1 &>(*this), key));
     }
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
@@ -385,6 +493,8 @@ class PartCertSecp256k1: public SigSecp256k1, public PartCert {
 };
 
 class QuorumCertSecp256k1: public QuorumCert {
+    /** the minimum number of signatures handed to a worker at once */
+    static const size_t verify_chunk_min = 8;
     uint256_t obj_hash;
     salticidae::Bits rids;
     std::unordered_map<ReplicaID, SigSecp256k1> sigs;
@@ -405,6 +515,7 @@ class QuorumCertSecp256k1: public QuorumCert {
 
     bool verify(const ReplicaConfig &config) override;
     promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
+    promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) override;
 
     const uint256_t &get_obj_hash() const override { return obj_hash; }
 
@@ -425,6 +536,621 @@ class QuorumCertSecp256k1: public QuorumCert {
     }
 };
 
+class PrivKeyEd25519;
+
+class PubKeyEd25519: public PubKey {
+    static const auto nbytes = 32;
+    friend class SigEd25519;
+    uint8_t data[nbytes];
+    EVP_PKEY *pkey;
+
+    void load() {
+        if (pkey) EVP_PKEY_free(pkey);
+        pkey = EVP_PKEY_new_raw_public_key(EVP_PKEY_ED25519, nullptr, data, nbytes);
+        if (pkey == nullptr)
+            throw std::invalid_argument("ill-formed public key");
+    }
+
+    public:
+    PubKeyEd25519(): PubKey(), pkey(nullptr) {}
+
+    PubKeyEd25519(const bytearray_t &raw_bytes):
+        PubKeyEd25519() { from_bytes(raw_bytes); }
+
+    inline PubKeyEd25519(const PrivKeyEd25519 &priv_key);
+
+    PubKeyEd25519(const PubKeyEd25519 &other):
+        PubKey(), pkey(other.pkey) {
+        memmove(data, other.data, nbytes);
+        if (pkey) EVP_PKEY_up_ref(pkey);
+    }
+
+    PubKeyEd25519 &operator=(const PubKeyEd25519 &) = delete;
+
+    ~PubKeyEd25519() {
+        if (pkey) EVP_PKEY_free(pkey);
+    }
+
+    void serialize(DataStream &s) const override {
+        s.put_data(data, data + nbytes);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed public key");
+        try {
+            memmove(data, s.get_data_inplace(nbytes), nbytes);
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+        load();
+    }
+
+    PubKeyEd25519 *clone() override {
+        return new PubKeyEd25519(*this);
+    }
+};
+
+class PrivKeyEd25519: public PrivKey {
+    static const auto nbytes = 32;
+    friend class PubKeyEd25519;
+    friend class SigEd25519;
+    uint8_t data[nbytes];
+    EVP_PKEY *pkey;
+
+    void load() {
+        if (pkey) EVP_PKEY_free(pkey);
+        pkey = EVP_PKEY_new_raw_private_key(EVP_PKEY_ED25519, nullptr, data, nbytes);
+        if (pkey == nullptr)
+            throw std::invalid_argument("invalid ed25519 private key");
+    }
+
+    public:
+    PrivKeyEd25519(): PrivKey(), pkey(nullptr) {}
+
+    PrivKeyEd25519(const bytearray_t &raw_bytes):
+        PrivKeyEd25519() { from_bytes(raw_bytes); }
+
+    PrivKeyEd25519(const PrivKeyEd25519 &) = delete;
+
+    ~PrivKeyEd25519() {
+        if (pkey) EVP_PKEY_free(pkey);
+    }
+
+    void serialize(DataStream &s) const override {
+        s.put_data(data, data + nbytes);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed private key");
+        try {
+            memmove(data, s.get_data_inplace(nbytes), nbytes);
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+        load();
+    }
+
+    void from_rand() override {
+        if (!RAND_bytes(data, nbytes))
+            throw std::runtime_error("cannot get rand bytes from openssl");
+        load();
+    }
+
+    inline pubkey_bt get_pubkey() const override;
+};
+
+pubkey_bt PrivKeyEd25519::get_pubkey() const {
+    return new PubKeyEd25519(*this);
+}
+
+PubKeyEd25519::PubKeyEd25519(const PrivKeyEd25519 &priv_key):
+        PubKey(), pkey(nullptr) {
+    size_t len = nbytes;
+    if (priv_key.pkey == nullptr ||
+        !EVP_PKEY_get_raw_public_key(priv_key.pkey, data, &len))
+        throw std::invalid_argument("invalid ed25519 private key");
+    load();
+}
+
+class SigEd25519: public Serializable {
+    static const auto nbytes = 64;
+    uint8_t data[nbytes];
+
+    static void check_msg_length(const bytearray_t &msg) {
+        if (msg.size() != 32)
+            throw std::invalid_argument("the message should be 32-bytes");
+    }
+
+    public:
+    SigEd25519(): Serializable() {}
+    SigEd25519(const uint256_t &digest, const PrivKeyEd25519 &priv_key):
+        Serializable() {
+        sign(digest, priv_key);
+    }
+
+    void serialize(DataStream &s) const override {
+        s.put_data(data, data + nbytes);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed signature");
+        try {
+            memmove(data, s.get_data_inplace(nbytes), nbytes);
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+    }
+
+    void sign(const bytearray_t &msg, const PrivKeyEd25519 &priv_key) {
+        check_msg_length(msg);
+        size_t len = nbytes;
+        auto ctx = EVP_MD_CTX_new();
+        bool ok = ctx && priv_key.pkey &&
+            EVP_DigestSignInit(ctx, nullptr, nullptr, nullptr, priv_key.pkey) == 1 &&
+            EVP_DigestSign(ctx, data, &len, &*msg.begin(), msg.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+        if (!ok)
+            throw std::invalid_argument("failed to create ed25519 signature");
+    }
+
+    bool verify(const bytearray_t &msg, const PubKeyEd25519 &pub_key) const {
+        check_msg_length(msg);
+        auto ctx = EVP_MD_CTX_new();
+        bool ok = ctx && pub_key.pkey &&
+            EVP_DigestVerifyInit(ctx, nullptr, nullptr, nullptr, pub_key.pkey) == 1 &&
+            EVP_DigestVerify(ctx, data, nbytes, &*msg.begin(), msg.size()) == 1;
+        EVP_MD_CTX_free(ctx);
+        return ok;
+    }
+
+    /** Get the key identifying (signer, msg, signature) in verified_sig_cache. */
+    uint256_t get_cache_key(const uint256_t &msg, const PubKeyEd25519 &pub_key) const {
+        DataStream s;
+        s.put_data(pub_key.data, pub_key.data + PubKeyEd25519::nbytes);
+        s << msg;
+        s.put_data(data, data + nbytes);
+        return s.get_hash();
+    }
+
+    bool is_cached(const uint256_t &key) const { return verified_sig_cache.lookup(key); }
+};
+
+class Ed25519VeriTask: public VeriTask {
+    uint256_t msg;
+    const PubKeyEd25519 &pubkey;  /**< owned by ReplicaConfig */
+    SigEd25519 sig;
+    uint256_t cache_key;
+    public:
+    Ed25519VeriTask(const uint256_t &msg,
+                    const PubKeyEd25519 &pubkey,
+                    const SigEd25519 &sig,
+                    const uint256_t &cache_key):
+        msg(msg), pubkey(pubkey), sig(sig), cache_key(cache_key) {}
+    virtual ~Ed25519VeriTask() = default;
+
+    bool verify() override {
+        if (!sig.verify(msg, pubkey))
+            return false;
+        verified_sig_cache.insert(cache_key);
+        return true;
+    }
+};
+
+/** Batched verification of the signatures of a QuorumCertEd25519.
+ * OpenSSL does not expose a multi-scalar Ed25519 batch verifier, so the batch
+ * is checked signature by signature on a single worker. */
+class Ed25519QuorumVeriTask: public VeriTask {
+    struct Entry {
+        const PubKeyEd25519 *pubkey;  /**< owned by ReplicaConfig */
+        SigEd25519 sig;
+        uint256_t cache_key;
+    };
+    uint256_t msg;
+    std::vector<Entry> sigs;
+    public:
+    Ed25519QuorumVeriTask(const uint256_t &msg): msg(msg) {}
+    virtual ~Ed25519QuorumVeriTask() = default;
+
+    void reserve(size_t n) { sigs.reserve(n); }
+
+    void add(const PubKeyEd25519 &pubkey, const SigEd25519 &sig,
+            const uint256_t &cache_key) {
+        sigs.push_back(Entry{&pubkey, sig, cache_key});
+    }
+
+    size_t size() const { return sigs.size(); }
+
+    bool verify() override {
+        for (const auto &e: sigs)
+        {
+            if (!e.sig.verify(msg, *e.pubkey))
+                return false;
+            verified_sig_cache.insert(e.cache_key);
+        }
+        return true;
+    }
+};
+
+class PartCertEd25519: public SigEd25519, public PartCert {
+    uint256_t obj_hash;
+
+    public:
+    PartCertEd25519() = default;
+    PartCertEd25519(const PrivKeyEd25519 &priv_key, const uint256_t &obj_hash):
+        SigEd25519(obj_hash, priv_key),
+        PartCert(),
+        obj_hash(obj_hash) {}
+
+    bool verify(const PubKey &pub_key) override {
+        const auto &pk = static_cast<const PubKeyEd25519 &>(pub_key);
+        auto key = get_cache_key(obj_hash, pk);
+        if (verified_sig_cache.lookup(key)) return true;
+        if (!SigEd25519::verify(obj_hash, pk))
+            return false;
+        verified_sig_cache.insert(key);
+        return true;
+    }
+
+    promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
+        const auto &pk = static_cast<const PubKeyEd25519 &>(pub_key);
+        auto key = get_cache_key(obj_hash, pk);
+        if (verified_sig_cache.lookup(key))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        return vpool.verify(new Ed25519VeriTask(obj_hash, pk,
+                static_cast<const SigEd25519 &>(*this), key));
+    }
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    PartCertEd25519 *clone() override {
+        return new PartCertEd25519(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash;
+        this->SigEd25519::serialize(s);
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash;
+        this->SigEd25519::unserialize(s);
+    }
+};
+
+class QuorumCertEd25519: public QuorumCert {
+    /** the minimum number of signatures handed to a worker at once */
+    static const size_t verify_chunk_min = 8;
+    uint256_t obj_hash;
+    salticidae::Bits rids;
+    std::unordered_map<ReplicaID, SigEd25519> sigs;
+
+    public:
+    QuorumCertEd25519() = default;
+    QuorumCertEd25519(const ReplicaConfig &config, const uint256_t &obj_hash);
+
+    void add_part(ReplicaID rid, const PartCert &pc) override {
+        if (pc.get_obj_hash() != obj_hash)
+            throw std::invalid_argument("PartCert does match the block hash");
+        sigs.insert(std::make_pair(
+            rid, static_cast<const PartCertEd25519 &>(pc)));
+        rids.set(rid);
+    }
+
+    void compute() override {}
+
+    bool verify(const ReplicaConfig &config) override;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
+    promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) override;
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    QuorumCertEd25519 *clone() override {
+        return new QuorumCertEd25519(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash << rids;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) s << sigs.at(i);
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash >> rids;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) s >> sigs[i];
+    }
+};
+
+
+/** Schnorr signature over secp256k1: (R, s) with R = kG, s = k + e * x and
+ * e = H(R || X || msg). Unlike ECDSA, Schnorr signatures on the same message
+ * can be half-aggregated, which is what QuorumCertHalfAggSecp256k1 builds on. */
+class SigSchnorrSecp256k1: public Serializable {
+    static const auto _olen = 33;
+    static const auto nbytes = 32;
+    secp256k1_pubkey r;
+    uint8_t s_data[nbytes];
+
+    static void put_point(DataStream &s, const secp256k1_pubkey &p);
+    static bool point_eq(const secp256k1_pubkey &a, const secp256k1_pubkey &b);
+    static bool get_challenge(uint8_t *e, const secp256k1_pubkey &r,
+                            const secp256k1_pubkey &x, const uint256_t &msg);
+
+    public:
+    /** A signer's share of an aggregate: its public key (owned by
+     * ReplicaConfig) and its R. */
+    using agg_entry_t = std::pair<const PubKeySecp256k1 *, secp256k1_pubkey>;
+
+    SigSchnorrSecp256k1(): Serializable() {}
+    SigSchnorrSecp256k1(const uint256_t &digest,
+                        const PrivKeySecp256k1 &priv_key):
+        Serializable() { sign(digest, priv_key); }
+
+    void serialize(DataStream &s) const override {
+        serialize_nonce(s);
+        s.put_data(s_data, s_data + nbytes);
+    }
+
+    void unserialize(DataStream &s) override {
+        static const auto _exc = std::invalid_argument("ill-formed signature");
+        unserialize_nonce(s);
+        try {
+            memmove(s_data, s.get_data_inplace(nbytes), nbytes);
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+    }
+
+    /** Only (de)serialize R, for certificates that carry an aggregated s. */
+    void serialize_nonce(DataStream &s) const { put_point(s, r); }
+
+    void unserialize_nonce(DataStream &s) {
+        static const auto _exc = std::invalid_argument("ill-formed signature");
+        try {
+            if (!secp256k1_ec_pubkey_parse(
+                    Secp256k1Context::get(), &r,
+                    s.get_data_inplace(_olen), _olen))
+                throw _exc;
+        } catch (std::ios_base::failure &) {
+            throw _exc;
+        }
+    }
+
+    void sign(const uint256_t &msg, const PrivKeySecp256k1 &priv_key);
+    bool verify(const uint256_t &msg, const PubKeySecp256k1 &pub_key) const;
+
+    const secp256k1_pubkey &get_nonce() const { return r; }
+    uint256_t get_s() const { return uint256_t(bytearray_t(s_data, s_data + nbytes)); }
+
+    /** Get the key identifying (signer, msg, R) in verified_sig_cache. The
+     * verified s is kept as the cached value, so an aggregate can later be
+     * recomputed from it without touching the curve. */
+    uint256_t get_cache_key(const uint256_t &msg, const PubKeySecp256k1 &pub_key) const;
+
+    /** Whether this exact signature has been verified: the cached s must
+     * match, as the key does not cover it. */
+    bool is_cached(const uint256_t &key) const {
+        uint256_t s;
+        return verified_sig_cache.lookup(key, &s) && s == get_s();
+    }
+
+    /** Compute sum(a_i * s_i) for the aggregation coefficients a_i. */
+    static bool aggregate(uint8_t *agg_s,
+                        const std::vector<bytearray_t> &coeffs,
+                        const std::vector<uint256_t> &ss);
+    /** Compute sum(a_i * (R_i + e_i * X_i)), the point that the aggregated s
+     * of these signers has to open to. */
+    static bool sum_terms(secp256k1_pubkey &sum, const uint256_t &msg,
+                        const std::vector<agg_entry_t> &entries,
+                        const std::vector<bytearray_t> &coeffs);
+    /** Check s * G == the sum of `parts`. */
+    static bool check_sum(const uint8_t *s, const std::vector<secp256k1_pubkey> &parts);
+};
+
+class SchnorrSecp256k1VeriTask: public VeriTask {
+    uint256_t msg;
+    const PubKeySecp256k1 &pubkey;  /**< owned by ReplicaConfig */
+    SigSchnorrSecp256k1 sig;
+    uint256_t cache_key;
+    public:
+    SchnorrSecp256k1VeriTask(const uint256_t &msg,
+                            const PubKeySecp256k1 &pubkey,
+                            const SigSchnorrSecp256k1 &sig,
+                            const uint256_t &cache_key):
+        msg(msg), pubkey(pubkey), sig(sig), cache_key(cache_key) {}
+    virtual ~SchnorrSecp256k1VeriTask() = default;
+
+    bool verify() override {
+        if (!sig.verify(msg, pubkey))
+            return false;
+        verified_sig_cache.insert(cache_key, sig.get_s());
+        return true;
+    }
+};
+
+/** Verification task that checks a batch of Schnorr signatures on the same
+ * message, one by one; each verified s is cached along with its key. */
+class SchnorrSecp256k1QuorumVeriTask: public VeriTask {
+    struct Entry {
+        const PubKeySecp256k1 *pubkey;  /**< owned by ReplicaConfig */
+        SigSchnorrSecp256k1 sig;
+        uint256_t cache_key;
+    };
+    uint256_t msg;
+    std::vector<Entry> sigs;
+    public:
+    SchnorrSecp256k1QuorumVeriTask(const uint256_t &msg): msg(msg) {}
+    virtual ~SchnorrSecp256k1QuorumVeriTask() = default;
+
+    void reserve(size_t n) { sigs.reserve(n); }
+
+    void add(const PubKeySecp256k1 &pubkey, const SigSchnorrSecp256k1 &sig,
+            const uint256_t &cache_key) {
+        sigs.push_back(Entry{&pubkey, sig, cache_key});
+    }
+
+    size_t size() const { return sigs.size(); }
+
+    bool verify() override {
+        for (const auto &e: sigs)
+        {
+            if (!e.sig.verify(msg, *e.pubkey))
+                return false;
+            verified_sig_cache.insert(e.cache_key, e.sig.get_s());
+        }
+        return true;
+    }
+};
+
+/** Verification task that sums the terms of a chunk of the signers of a
+ * half-aggregated quorum signature; the chunks are checked against the
+ * aggregated s once all of them are done. */
+class Secp256k1HalfAggVeriTask: public VeriTask {
+    uint256_t msg;
+    std::vector<SigSchnorrSecp256k1::agg_entry_t> entries;
+    std::vector<bytearray_t> coeffs;
+    /** the partial sums of all chunks; this task only writes parts[idx] */
+    std::shared_ptr<std::vector<secp256k1_pubkey>> parts;
+    size_t idx;
+    public:
+    Secp256k1HalfAggVeriTask(const uint256_t &msg,
+                        const std::shared_ptr<std::vector<secp256k1_pubkey>> &parts,
+                        size_t idx):
+            msg(msg), parts(parts), idx(idx) {}
+    virtual ~Secp256k1HalfAggVeriTask() = default;
+
+    void reserve(size_t n) {
+        entries.reserve(n);
+        coeffs.reserve(n);
+    }
+
+    void add(const SigSchnorrSecp256k1::agg_entry_t &entry, bytearray_t &&coeff) {
+        entries.push_back(entry);
+        coeffs.push_back(std::move(coeff));
+    }
+
+    size_t size() const { return entries.size(); }
+
+    bool verify() override {
+        return SigSchnorrSecp256k1::sum_terms((*parts)[idx], msg, entries, coeffs);
+    }
+};
+
+class PartCertSchnorrSecp256k1: public SigSchnorrSecp256k1, public PartCert {
+    uint256_t obj_hash;
+
+    public:
+    PartCertSchnorrSecp256k1() = default;
+    PartCertSchnorrSecp256k1(const PrivKeySecp256k1 &priv_key, const uint256_t &obj_hash):
+        SigSchnorrSecp256k1(obj_hash, priv_key),
+        PartCert(),
+        obj_hash(obj_hash) {}
+
+    bool verify(const PubKey &pub_key) override {
+        const auto &pk = static_cast<const PubKeySecp256k1 &>(pub_key);
+        auto key = get_cache_key(obj_hash, pk);
+        if (is_cached(key)) return true;
+        if (!SigSchnorrSecp256k1::verify(obj_hash, pk))
+            return false;
+        verified_sig_cache.insert(key, get_s());
+        return true;
+    }
+
+    promise_t verify(const PubKey &pub_key, VeriPool &vpool) override {
+        const auto &pk = static_cast<const PubKeySecp256k1 &>(pub_key);
+        auto key = get_cache_key(obj_hash, pk);
+        if (is_cached(key))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        return vpool.verify(new SchnorrSecp256k1VeriTask(obj_hash, pk,
+                static_cast<const SigSchnorrSecp256k1 &>(*this), key));
+    }
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    PartCertSchnorrSecp256k1 *clone() override {
+        return new PartCertSchnorrSecp256k1(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash;
+        this->SigSchnorrSecp256k1::serialize(s);
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash;
+        this->SigSchnorrSecp256k1::unserialize(s);
+    }
+};
+
+/** Half-aggregated quorum certificate of Schnorr signatures: it carries one
+ * R per signer (33 bytes) plus a single combined s, instead of a full 64-byte
+ * signature per signer. Both its size and its verification cost still grow
+ * with the number of signers; it is not constant-size: dropping the R's
+ * (MuSig-style) needs the signers to agree on an aggregate nonce before
+ * signing, which takes a round the one-shot votes do not have. Verification
+ * costs two point multiplications for each signer whose vote has not been
+ * verified locally, so it is only cheaper than QuorumCertSecp256k1 when most
+ * votes are already in verified_sig_cache. */
+class QuorumCertHalfAggSecp256k1: public QuorumCert {
+    /** the minimum number of signers handed to a worker at once */
+    static const size_t verify_chunk_min = 8;
+    uint256_t obj_hash;
+    salticidae::Bits rids;
+    /** the partial signatures; only R is known after unserialization */
+    std::unordered_map<ReplicaID, SigSchnorrSecp256k1> sigs;
+    uint8_t agg_s[32];
+
+    bool get_agg_coeffs(std::vector<bytearray_t> &coeffs) const;
+    bool split_cached(const ReplicaConfig &config,
+                    std::vector<bytearray_t> &coeffs,
+                    std::vector<SigSchnorrSecp256k1::agg_entry_t> &entries,
+                    uint8_t *rest) const;
+
+    public:
+    QuorumCertHalfAggSecp256k1() = default;
+    QuorumCertHalfAggSecp256k1(const ReplicaConfig &config, const uint256_t &obj_hash);
+
+    void add_part(ReplicaID rid, const PartCert &pc) override {
+        if (pc.get_obj_hash() != obj_hash)
+            throw std::invalid_argument("PartCert does match the block hash");
+        sigs.insert(std::make_pair(
+            rid, static_cast<const PartCertSchnorrSecp256k1 &>(pc)));
+        rids.set(rid);
+    }
+
+    void compute() override;
+
+    bool verify(const ReplicaConfig &config) override;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool) override;
+    /** Only for a certificate built with add_part(): an unserialized one has
+     * no partial s_i to check. */
+    promise_t verify_parts(const ReplicaConfig &config, VeriPool &vpool) override;
+
+    const uint256_t &get_obj_hash() const override { return obj_hash; }
+
+    QuorumCertHalfAggSecp256k1 *clone() override {
+        return new QuorumCertHalfAggSecp256k1(*this);
+    }
+
+    void serialize(DataStream &s) const override {
+        s << obj_hash << rids;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) sigs.at(i).serialize_nonce(s);
+        s.put_data(agg_s, agg_s + sizeof agg_s);
+    }
+
+    void unserialize(DataStream &s) override {
+        s >> obj_hash >> rids;
+        for (size_t i = 0; i < rids.size(); i++)
+            if (rids.get(i)) sigs[i].unserialize_nonce(s);
+        try {
+            memmove(agg_s, s.get_data_inplace(sizeof agg_s), sizeof agg_s);
+        } catch (std::ios_base::failure &) {
+            throw std::invalid_argument("ill-formed signature");
+        }
+    }
+};
+
 }
 
 #endif
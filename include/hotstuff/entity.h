@@ -18,6 +18,7 @@
 #define _HOTSTUFF_ENT_H
 
 #include <vector>
+#include <queue>
 #include <unordered_map>
 #include <unordered_set>
 #include <string>
@@ -58,16 +59,24 @@ struct ReplicaInfo {
 
 class ReplicaConfig {
     std::unordered_map<ReplicaID, ReplicaInfo> replica_map;
+    /** public keys indexed by ReplicaID, pointing into replica_map */
+    std::vector<const PubKey *> pubkeys;
 
     public:
     size_t nreplicas;
     size_t nmajority;
+    /** votes needed to commit a block without waiting for its commit timer
+     * (0 to disable) */
+    size_t nfast;
     double delta;
 
-    ReplicaConfig(): nreplicas(0), nmajority(0), delta(0) {}
+    ReplicaConfig(): nreplicas(0), nmajority(0), nfast(0), delta(0) {}
+    ReplicaConfig(const ReplicaConfig &) = delete;
 
     void add_replica(ReplicaID rid, const ReplicaInfo &info) {
-        replica_map.insert(std::make_pair(rid, info));
+        auto it = replica_map.insert(std::make_pair(rid, info)).first;
+        if (rid >= pubkeys.size()) pubkeys.resize(rid + 1, nullptr);
+        pubkeys[rid] = it->second.pubkey.get();
         nreplicas++;
     }
 
@@ -80,6 +89,8 @@ class ReplicaConfig {
     }
 
     const PubKey &get_pubkey(ReplicaID rid) const {
+        if (rid < pubkeys.size() && pubkeys[rid])
+            return *pubkeys[rid];
         return *(get_info(rid).pubkey);
     }
 
@@ -90,6 +101,7 @@ class ReplicaConfig {
 
 class Block;
 class HotStuffCore;
+class EntityStorage;
 
 using block_t = salticidae::ArcObj<Block>;
 
@@ -126,8 +138,14 @@ class Block {
     bytearray_t extra;
 
     /* the following fields can be derived from above */
+    /** the block serialized once, shared by the messages carrying it */
+    salticidae::ArcObj<DataStream> serialized;
     uint256_t hash;
     std::vector<block_t> parents;
+    /** an ancestor further down, at get_skip_height(height), set upon the
+     * delivery; not owned, so it is never followed into the pruned heights,
+     * nor below the height being looked for */
+    const Block *skip;
     block_t qc_ref;
     quorum_cert_bt self_qc;
     uint32_t height;
@@ -136,19 +154,41 @@ class Block {
 
     std::unordered_set<ReplicaID> voted;
 
+    void serialize_tail(DataStream &s) const;
+    void unserialize_tail(DataStream &s, HotStuffCore *hsc);
+    /** Keep `s` as the serialized form of the block and hash it. */
+    void set_serialized(DataStream &&s) {
+        hash = s.get_hash();
+        serialized = new DataStream(std::move(s));
+    }
+    /** Keep a copy of [begin, end) as the serialized form of the block; the
+     * hash is taken straight from the buffer the bytes were received in. */
+    void set_serialized(const uint8_t *begin, const uint8_t *end) {
+        SHA256 d;
+        d.update(begin, end - begin);
+        hash = uint256_t(d.digest());
+        serialized = new DataStream(begin, end);
+    }
+
     public:
+    /** the number of bytes of a short command ID on the wire */
+    static const size_t short_cmd_id_size = 6;
+
     Block():
         qc(nullptr),
+        serialized(nullptr),
+        skip(nullptr),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
         delivered(false), decision(0) {}
 
     Block(bool delivered, int8_t decision):
         qc(nullptr),
-        hash(salticidae::get_hash(*this)),
+        serialized(nullptr),
+        skip(nullptr),
         qc_ref(nullptr),
         self_qc(nullptr), height(0),
-        delivered(delivered), decision(decision) {}
+        delivered(delivered), decision(decision) { update_hash(); }
 
     Block(const std::vector<block_t> &parents,
         const std::vector<uint256_t> &cmds,
@@ -163,18 +203,44 @@ class Block {
             qc(std::move(qc)),
             qc_ref_hash(qc_ref ? qc_ref->get_hash() : uint256_t()),
             extra(std::move(extra)),
-            hash(salticidae::get_hash(*this)),
+            serialized(nullptr),
             parents(parents),
+            skip(nullptr),
             qc_ref(qc_ref),
             self_qc(std::move(self_qc)),
             height(height),
             delivered(0),
-            decision(decision) {}
+            decision(decision) { update_hash(); }
 
+    /** Write the block to `s`, copying its serialized form once there is. */
     void serialize(DataStream &s) const;
 
+    /** Parse a block from `s`, which should hold the output of serialize():
+     * the hash is taken over the bytes consumed. Throws
+     * std::invalid_argument on a non-canonical encoding. */
     void unserialize(DataStream &s, HotStuffCore *hsc);
 
+    /** Get the short ID of a command under `salt`. It is not collision
+     * resistant: a wrong reconstruction shows up as a different block hash. */
+    static uint64_t get_short_cmd_id(const uint256_t &cmd_hash, uint64_t salt);
+
+    /** Serialize with the commands replaced by their short IDs under `salt`. */
+    void serialize_compact(DataStream &s, uint64_t salt) const;
+
+    /** Parse the output of serialize_compact(). The commands are left to be
+     * filled in by set_cmd() from `short_ids`, followed by update_hash(). */
+    void unserialize_compact(DataStream &s, HotStuffCore *hsc,
+                            uint64_t &salt, std::vector<uint64_t> &short_ids);
+
+    void set_cmd(size_t idx, const uint256_t &cmd_hash) { cmds[idx] = cmd_hash; }
+
+    void update_hash() {
+        serialized = nullptr;
+        DataStream s;
+        serialize(s);
+        set_serialized(std::move(s));
+    }
+
     const std::vector<uint256_t> &get_cmds() const {
         return cmds;
     }
@@ -189,8 +255,30 @@ class Block {
 
     const uint256_t &get_hash() const { return hash; }
 
-    bool verify(const ReplicaConfig &config) const;
-    promise_t verify(const ReplicaConfig &config, VeriPool &vpool) const;
+    /** Get the height of the skip pointer of a block at `height`. */
+    static uint32_t get_skip_height(uint32_t height) {
+        /* clear the lowest set bit */
+        auto invert_lowest_one = [](uint32_t n) { return n & (n - 1); };
+        if (height < 2) return 0;
+        return (height & 1) ?
+            invert_lowest_one(invert_lowest_one(height - 1)) + 1 :
+            invert_lowest_one(height);
+    }
+
+    /** Get the ancestor (following parents[0]) at `height` in O(log distance)
+     * steps, or nullptr if it is not reachable. The block should be
+     * delivered. Blocks up to `pruned_height` may have been freed, so skip
+     * pointers into those heights are not taken. */
+    const Block *get_ancestor(uint32_t height, uint32_t pruned_height) const;
+
+    /** Whether `blk` is this block or one of its ancestors. */
+    bool extends(const Block &blk, uint32_t pruned_height) const {
+        return get_ancestor(blk.height, pruned_height) == &blk;
+    }
+
+    bool verify(const ReplicaConfig &config, EntityStorage &storage) const;
+    promise_t verify(const ReplicaConfig &config, VeriPool &vpool,
+                    EntityStorage &storage) const;
 
     int8_t get_decision() const { return decision; }
 
@@ -206,6 +294,13 @@ class Block {
 
     const uint256_t &get_qc_ref_hash() const { return qc_ref_hash; }
 
+    /** Approximate memory footprint, excluding the certificates. */
+    size_t get_mem_size() const {
+        return sizeof(Block) + extra.size() +
+            (parent_hashes.size() + cmds.size()) * sizeof(uint256_t) +
+            (serialized ? serialized->size() : 0);
+    }
+
     operator std::string () const {
         DataStream s;
         s << "<block "
@@ -224,9 +319,51 @@ struct BlockHeightCmp {
 };
 
 class EntityStorage {
+    /** the number of verified quorum certificates remembered */
+    static const size_t verified_qc_capacity = 1024;
     std::unordered_map<const uint256_t, block_t> blk_cache;
+    /** approximate size of the blocks in blk_cache */
+    size_t blk_cache_bytes;
     std::unordered_map<const uint256_t, command_t> cmd_cache;
+    /* digests of the quorum certificates known to be valid */
+    std::unordered_set<uint256_t> verified_qcs;
+    std::queue<uint256_t> verified_qc_fifo;
+
+    void add_verified_qc(const uint256_t &qc_hash) {
+        if (!verified_qcs.insert(qc_hash).second) return;
+        verified_qc_fifo.push(qc_hash);
+        if (verified_qc_fifo.size() > verified_qc_capacity)
+        {
+            verified_qcs.erase(verified_qc_fifo.front());
+            verified_qc_fifo.pop();
+        }
+    }
+
     public:
+    EntityStorage(): blk_cache_bytes(0) {}
+
+    /** Verify a quorum certificate, unless the very same certificate has
+     * been verified before. The digest covers the whole certificate
+     * (obj_hash, signer bitmap and signatures), so a replayed (obj_hash,
+     * bitmap) with forged signatures is still checked. */
+    bool verify_qc(QuorumCert &qc, const ReplicaConfig &config) {
+        auto qc_hash = salticidae::get_hash(qc);
+        if (verified_qcs.count(qc_hash)) return true;
+        if (!qc.verify(config)) return false;
+        add_verified_qc(qc_hash);
+        return true;
+    }
+
+    promise_t verify_qc(QuorumCert &qc, const ReplicaConfig &config, VeriPool &vpool) {
+        auto qc_hash = salticidae::get_hash(qc);
+        if (verified_qcs.count(qc_hash))
+            return promise_t([](promise_t &pm) { pm.resolve(true); });
+        return qc.verify(config, vpool).then([this, qc_hash](bool result) {
+            if (result) add_verified_qc(qc_hash);
+            return result;
+        });
+    }
+
     bool is_blk_delivered(const uint256_t &blk_hash) {
         auto it = blk_cache.find(blk_hash);
         if (it == blk_cache.end()) return false;
@@ -244,11 +381,13 @@ class EntityStorage {
         //    return nullptr;
         //}
         block_t blk = new Block(std::move(_blk));
-        return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
+        return add_blk(blk);
     }
 
     const block_t &add_blk(const block_t &blk) {
-        return blk_cache.insert(std::make_pair(blk->get_hash(), blk)).first->second;
+        auto it = blk_cache.insert(std::make_pair(blk->get_hash(), blk));
+        if (it.second) blk_cache_bytes += blk->get_mem_size();
+        return it.first->second;
     }
 
     block_t find_blk(const uint256_t &blk_hash) {
@@ -275,6 +414,9 @@ class EntityStorage {
     size_t get_blk_cache_size() {
         return blk_cache.size();
     }
+    size_t get_blk_cache_bytes() {
+        return blk_cache_bytes;
+    }
 
     bool try_release_cmd(const command_t &cmd) {
         if (cmd.get_cnt() == 2) /* only referred by cmd and the storage */
@@ -295,6 +437,7 @@ class EntityStorage {
 #endif
 //            for (const auto &cmd: blk->get_cmds())
 //                try_release_cmd(cmd);
+            blk_cache_bytes -= blk->get_mem_size();
             blk_cache.erase(blk_hash);
             return true;
         }
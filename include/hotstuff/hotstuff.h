@@ -18,7 +18,10 @@
 #ifndef _HOTSTUFF_CORE_H
 #define _HOTSTUFF_CORE_H
 
+#include <algorithm>
+#include <deque>
 #include <queue>
+#include <random>
 #include <unordered_map>
 #include <unordered_set>
 
@@ -105,6 +108,75 @@ struct MsgRespBlock {
     void postponed_parse(HotStuffCore *hsc);
 };
 
+/** A proposal with the commands of the block sent as short IDs, see
+ * HotStuffBase::enable_compact_proposal(). */
+struct MsgProposeCompact {
+    static const opcode_t opcode = 0x7;
+    DataStream serialized;
+    ReplicaID proposer;
+    uint256_t blk_hash;
+    uint64_t salt;
+    std::vector<uint64_t> short_ids;
+    /** the block with its commands yet to be filled in */
+    Block blk;
+    MsgProposeCompact(const Proposal &, uint64_t salt);
+    MsgProposeCompact(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Requests the commands of a compact proposal at the given positions. */
+struct MsgReqCmds {
+    static const opcode_t opcode = 0x8;
+    DataStream serialized;
+    uint256_t blk_hash;
+    std::vector<uint32_t> idx;
+    MsgReqCmds(const uint256_t &blk_hash, const std::vector<uint32_t> &idx);
+    MsgReqCmds(DataStream &&s);
+};
+
+struct MsgRespCmds {
+    static const opcode_t opcode = 0x9;
+    DataStream serialized;
+    uint256_t blk_hash;
+    std::vector<uint32_t> idx;
+    std::vector<uint256_t> cmds;
+    MsgRespCmds(const uint256_t &blk_hash,
+                const std::vector<uint32_t> &idx,
+                const std::vector<uint256_t> &cmds);
+    MsgRespCmds(DataStream &&s);
+};
+
+/** Several messages for the same peer, each packed as its opcode, length and
+ * payload, see HotStuffBase::enable_coalescing(). */
+struct MsgBatch {
+    static const opcode_t opcode = 0xa;
+    DataStream serialized;
+    MsgBatch(DataStream &&s): serialized(std::move(s)) {}
+};
+
+/** The votes of a subtree of the vote aggregation tree, see
+ * HotStuffBase::set_vote_aggregation(). */
+struct MsgVoteBundle {
+    static const opcode_t opcode = 0xb;
+    DataStream serialized;
+    VoteBundle bundle;
+    MsgVoteBundle(const VoteBundle &);
+    MsgVoteBundle(DataStream &&s): serialized(std::move(s)) {}
+    void postponed_parse(HotStuffCore *hsc);
+};
+
+/** Tells every replica which block a voter voted for at a height, so that
+ * an equivocation is still noticed when the votes go up a tree. */
+struct MsgVoteEcho {
+    static const opcode_t opcode = 0xc;
+    DataStream serialized;
+    ReplicaID voter;
+    uint256_t blk_hash;
+    uint32_t height;
+    MsgVoteEcho(ReplicaID voter, const uint256_t &blk_hash, uint32_t height);
+    MsgVoteEcho(DataStream &&s);
+};
+
 using promise::promise_t;
 
 class HotStuffBase;
@@ -147,6 +219,50 @@ class BlockDeliveryContext: public promise_t {
     }
 };
 
+/** Estimates the network delay bound as a high percentile of the recent delay
+ * samples of each peer (taking the slowest peer), times a safety factor,
+ * clamped to [dmin, dmax]. */
+class DelayEstimator {
+    /** the number of recent samples kept per peer */
+    size_t window;
+    double percentile;
+    double factor;
+    double dmin;
+    double dmax;
+    std::unordered_map<ReplicaID, std::deque<double>> samples;
+
+    public:
+    DelayEstimator(size_t window, double percentile, double factor,
+                    double dmin, double dmax):
+        window(std::max(window, (size_t)1)), percentile(percentile),
+        factor(factor), dmin(dmin), dmax(dmax) {}
+
+    size_t get_window() const { return window; }
+
+    /** The delta that covers a single delay sample. */
+    double bound(double delay) const {
+        return std::min(std::max(delay * factor, dmin), dmax);
+    }
+
+    void add(ReplicaID peer, double delay) {
+        auto &s = samples[peer];
+        s.push_back(delay);
+        if (s.size() > window) s.pop_front();
+    }
+
+    double get() const {
+        double d = 0;
+        std::vector<double> v;
+        for (const auto &p: samples)
+        {
+            v.assign(p.second.begin(), p.second.end());
+            size_t k = std::min(v.size() - 1, (size_t)(percentile * v.size()));
+            std::nth_element(v.begin(), v.begin() + k, v.end());
+            d = std::max(d, v[k]);
+        }
+        return std::min(std::max(d * factor, dmin), dmax);
+    }
+};
 
 /** HotStuff protocol (with network implementation). */
 class HotStuffBase: public HotStuffCore {
@@ -163,16 +279,119 @@ class HotStuffBase: public HotStuffCore {
     protected:
     /** the binding address in replica network */
     NetAddr listen_addr;
-    /** the block size */
+    /** the block size (the current target when batching adaptively) */
     size_t blk_size;
+    /* adaptive batching, see set_batching() */
+    size_t blk_size_min;
+    size_t blk_size_max;
+    double batch_max_wait;
+    /** the lowest QC latency seen for its own blocks */
+    double qc_lat_base;
+    TimerEvent batch_timer;
+    bool batch_timer_armed;
     /** libevent handle */
     EventContext ec;
     salticidae::ThreadCall tcall;
     VeriPool vpool;
     std::vector<NetAddr> peers;
-    std::unordered_map<uint32_t, TimerEvent> commit_timers;
+    /** A block to commit at the deadline, unless its epoch is over. */
+    struct CommitEntry {
+        double deadline;
+        block_t blk;
+        uint32_t epoch;
+    };
+    /** pending commits in deadline order, served by a single timer */
+    std::deque<CommitEntry> commit_queue;
+    TimerEvent commit_timer;
+    /** bumped to drop all pending commits at once */
+    uint32_t commit_epoch;
     TimerEvent blame_timer;
     TimerEvent viewtrans_timer;
+    /* pruning policy, see set_prune_policy() */
+    uint32_t prune_staleness;
+    uint32_t prune_interval;
+    size_t blk_cache_budget;
+    size_t prune_batch;
+    TimerEvent prune_timer;
+    bool prune_scheduled;
+    /* adaptive delta, see enable_adaptive_delta() */
+    /** the number of recent blocks whose proposal time is kept */
+    static const size_t blk_seen_capacity = 64;
+    /** the number of delay samples between two updates of delta */
+    static const size_t delta_update_period = 16;
+    BoxObj<DelayEstimator> delay_est;
+    /** when each recent block was proposed by this replica */
+    std::unordered_map<const uint256_t, double> blk_seen_time;
+    std::queue<uint256_t> blk_seen_order;
+    size_t ndelay_sample;
+    /** the number of samples since the estimate went below delta */
+    size_t ndelay_low;
+    /* offloaded execution, see enable_executor() */
+    BoxObj<Executor<block_t>> executor;
+    /** committed blocks waiting for room in the executor queue */
+    std::queue<block_t> exec_backlog;
+    /** the last block handed back by the executor; the blocks above it may
+     * still be read by the executor thread, so pruning starts below it */
+    block_t b_executed;
+    /* compact proposals, see enable_compact_proposal() */
+    bool compact_proposal;
+    std::mt19937_64 salt_gen;
+    /** the number of compact proposals sharing a salt */
+    static const uint32_t salt_period = 256;
+    /** the salt of the outgoing compact proposals */
+    uint64_t salt;
+    uint32_t salt_uses;
+    /** the most commands that short_id_index covers */
+    static const size_t short_id_index_capacity = 1 << 20;
+    /** short IDs under short_id_salt of the commands in decision_waiting
+     * (nullptr marks a collision); it follows decision_waiting, so it is only
+     * rebuilt when the current proposer moves to a new salt, at most once
+     * every salt_period of its proposals */
+    std::unordered_map<uint64_t, const uint256_t *> short_id_index;
+    /** the proposer whose salt short_id_index is built for */
+    ReplicaID short_id_owner;
+    uint64_t short_id_salt;
+    /** compact proposals received from short_id_owner since the rebuild */
+    uint32_t short_id_nprop;
+    bool short_id_indexed;
+    /** A compact proposal waiting for some of its commands. */
+    struct CompactContext {
+        ReplicaID proposer;
+        Block blk;
+        NetAddr peer;
+        /** positions of the commands requested from the proposer */
+        std::vector<uint32_t> missing;
+        /** whether all commands have been requested */
+        bool full;
+    };
+    /** the number of compact proposals kept waiting for their commands */
+    static const size_t compact_waiting_capacity = 64;
+    std::unordered_map<const uint256_t, CompactContext> compact_waiting;
+    std::queue<uint256_t> compact_waiting_order;
+    /* message coalescing, see enable_coalescing() */
+    size_t coalesce_threshold;
+    /** messages packed for each peer, flushed at the next loop iteration */
+    std::unordered_map<const NetAddr, DataStream> out_batches;
+    TimerEvent flush_timer;
+    bool flush_scheduled;
+    /* vote aggregation, see set_vote_aggregation() */
+    size_t vote_fanout;
+    double vote_agg_wait;
+    /** The votes a replica collects from its subtree for a block. */
+    struct VoteAggContext {
+        ReplicaID root;
+        uint32_t height;
+        VoteBundle bundle;
+        std::unordered_set<ReplicaID> voters;
+        /** whether the bundle has gone to the parent */
+        bool sent;
+        /** fires once to send a partial bundle to the parent, then once
+         * more to send the bundle to the root if no QC came back */
+        TimerEvent timer;
+        VoteAggContext(ReplicaID root, uint32_t height, const VoteBundle &bundle):
+            root(root), height(height), bundle(bundle), sent(false) {}
+    };
+    std::unordered_map<const uint256_t, VoteAggContext> vote_agg_waiting;
 
     private:
     /** whether libevent handle is owned by itself */
@@ -206,6 +425,15 @@ class HotStuffBase: public HotStuffCore {
     mutable double part_delivery_time;
     mutable double part_delivery_time_min;
     mutable double part_delivery_time_max;
+    mutable uint32_t part_nbatch;
+    mutable uint64_t part_batch_size;
+    mutable uint32_t part_batch_deadline;
+    mutable uint32_t part_nqc;
+    mutable double part_qc_lat;
+    mutable uint32_t part_compact;
+    mutable uint32_t part_compact_missing;
+    mutable uint32_t part_coalesced;
+    mutable uint32_t part_coalesced_frames;
     mutable std::unordered_map<const NetAddr, uint32_t> part_fetched_replica;
 
 #ifdef SYNCHS_LATBREAKDOWN
@@ -232,14 +460,86 @@ class HotStuffBase: public HotStuffCore {
     void on_fetch_cmd(const command_t &cmd);
     void on_fetch_blk(const block_t &blk);
     void on_deliver_blk(const block_t &blk);
+    void on_commit_timer();
+    void propose_batch(size_t size);
+    void on_batch_timer();
+    void on_batch_qc(double lat);
+    void schedule_prune();
+    void on_prune_tick();
+    void on_blk_seen(const uint256_t &blk_hash);
+    void on_vote_delay(const Vote &vote, double arrival);
+    void on_decide_block_done(const block_t &blk);
+    void on_exec_done(block_t &&blk);
+    void on_proposal(Proposal &&prop, const NetAddr &peer);
+    bool on_compact_blk(const uint256_t &blk_hash, CompactContext &ctx);
+    void rebuild_short_id_index(ReplicaID proposer, uint64_t salt);
+    /** `cmd_hash` should be the key kept in decision_waiting. */
+    void index_short_id(const uint256_t &cmd_hash);
+    void unindex_short_id(const uint256_t &cmd_hash);
+    void add_to_batch(opcode_t opcode, const DataStream &s, const NetAddr &addr);
+    void flush_batch(const NetAddr &addr);
+    void flush_batches();
+    /** Get the position of `rid` in the aggregation tree rooted at `root`. */
+    size_t get_vote_tree_pos(ReplicaID rid, ReplicaID root) const {
+        size_t n = get_config().nreplicas;
+        return (rid + n - root) % n;
+    }
+    ReplicaID get_vote_parent(ReplicaID root) const;
+    /** The number of replicas in the subtree of this one, itself included. */
+    size_t get_vote_subtree_size(ReplicaID root) const;
+    size_t get_vote_tree_depth(ReplicaID root) const;
+    /** Add the votes to the bundle of the block for the parent, and send it
+     * once the whole subtree has voted. */
+    void aggregate_votes(const VoteBundle &bundle, uint32_t height);
+    void send_vote_bundle(const uint256_t &blk_hash);
+    void on_vote_agg_timeout(const uint256_t &blk_hash);
+    /** Drop the aggregation of the blocks below `height`. */
+    void prune_vote_agg(uint32_t height);
+
+    /** Send a small message, through the batch of the peer if coalescing. */
+    template<typename M>
+    void send_coalesced(const M &m, const NetAddr &addr) {
+        if (coalesce_threshold)
+            add_to_batch(M::opcode, m.serialized, addr);
+        else
+            pn.send_msg(m, addr);
+    }
+
+    template<typename M>
+    void multicast_coalesced(const M &m, const std::vector<NetAddr> &addrs) {
+        if (!coalesce_threshold)
+        {
+            pn.multicast_msg(m, addrs);
+            return;
+        }
+        for (const auto &addr: addrs)
+            add_to_batch(M::opcode, m.serialized, addr);
+    }
+    /** Whether the proposer should hold off until execution catches up. */
+    bool is_exec_throttled() const {
+        return executor &&
+            executor->get_ninflight() + exec_backlog.size() >= executor->get_capacity();
+    }
 
     /** deliver consensus message: <propose> */
     inline void propose_handler(MsgPropose &&, const Net::conn_t &);
     /** deliver consensus message: <vote> */
     inline void vote_handler(MsgVote &&, const Net::conn_t &);
     inline void notify_handler(MsgNotify &&, const Net::conn_t &);
+    /** deliver the votes of a subtree of the aggregation tree */
+    inline void vote_bundle_handler(MsgVoteBundle &&, const Net::conn_t &);
+    /** learns the block a replica voted for at a height */
+    inline void vote_echo_handler(MsgVoteEcho &&, const Net::conn_t &);
     inline void blame_handler(MsgBlame &&, const Net::conn_t &);
     inline void blamenotify_handler(MsgBlameNotify &&, const Net::conn_t &);
+    /** deliver consensus message: <propose> with short command IDs */
+    inline void propose_compact_handler(MsgProposeCompact &&, const Net::conn_t &);
+    /** fetches the commands of a compact proposal */
+    inline void req_cmds_handler(MsgReqCmds &&, const Net::conn_t &);
+    /** receives the commands of a compact proposal */
+    inline void resp_cmds_handler(MsgRespCmds &&, const Net::conn_t &);
+    /** unpacks coalesced messages to their handlers */
+    inline void batch_handler(MsgBatch &&, const Net::conn_t &);
 
     /** fetches full block data */
     inline void req_blk_handler(MsgReqBlock &&, const Net::conn_t &);
@@ -250,13 +550,22 @@ class HotStuffBase: public HotStuffCore {
     template<typename T, typename M>
     void _do_broadcast(const T &t) {
         //M m(t);
-        pn.multicast_msg(M(t), peers);
+        multicast_coalesced(M(t), peers);
         //for (const auto &replica: peers)
         //    pn.send_msg(m, replica);
     }
 
     void do_broadcast_proposal(const Proposal &prop) override {
-        _do_broadcast<Proposal, MsgPropose>(prop);
+        if (delay_est) on_blk_seen(prop.blk->get_hash());
+        /* proposals are not coalesced, so send what is queued before them */
+        if (coalesce_threshold) flush_batches();
+        if (compact_proposal)
+        {
+            if (salt_uses++ % salt_period == 0) salt = salt_gen();
+            pn.multicast_msg(MsgProposeCompact(prop, salt), peers);
+        }
+        else
+            pn.multicast_msg(MsgPropose(prop), peers);
     }
 
     void do_broadcast_vote(const Vote &vote) override {
@@ -269,10 +578,23 @@ class HotStuffBase: public HotStuffCore {
                 //on_receive_vote(vote);
             }
             else
-                pn.send_msg(MsgVote(vote), get_config().get_addr(proposer));
+                send_coalesced(MsgVote(vote), get_config().get_addr(proposer));
         });
 #else
-        _do_broadcast<Vote, MsgVote>(vote);
+        if (vote_fanout)
+        {
+            /* the vote itself goes up the tree, but everyone still learns
+             * which block it is for to notice an equivocation */
+            auto blk = storage->find_blk(vote.blk_hash);
+            if (blk == nullptr) return;
+            multicast_coalesced(MsgVoteEcho(vote.voter, vote.blk_hash,
+                                            blk->get_height()), peers);
+            VoteBundle bundle(vote.blk_hash, this);
+            bundle.add(vote);
+            aggregate_votes(bundle, blk->get_height());
+        }
+        else
+            _do_broadcast<Vote, MsgVote>(vote);
 #endif
 
     }
@@ -286,6 +608,7 @@ class HotStuffBase: public HotStuffCore {
     }
 
     void do_notify(const Notify &notify) override;
+    void do_broadcast_qc(const Notify &notify) override;
 
     void set_commit_timer(const block_t &blk, double t_sec) override;
     void stop_commit_timer(uint32_t height) override;
@@ -296,6 +619,7 @@ class HotStuffBase: public HotStuffCore {
     void stop_viewtrans_timer() override;
 
     void do_decide(Finality &&) override;
+    void do_decide_block(const block_t &blk) override;
     void do_consensus(const block_t &blk) override;
 
     protected:
@@ -303,6 +627,15 @@ class HotStuffBase: public HotStuffCore {
     /** Called to replicate the execution of a command, the application should
      * implement this to make transition for the application state. */
     virtual void state_machine_execute(const Finality &) = 0;
+    /** Called to replicate the execution of a committed block, with `cmds`
+     * being its commands. By default, it calls state_machine_execute() for
+     * each command. It runs on the executor thread once enable_executor() is
+     * called, where `blk` must only be read. */
+    virtual void state_machine_execute_block(const block_t &blk,
+                                            const std::vector<uint256_t> &cmds);
+    /** Called after the callbacks of the commands in a committed block are
+     * invoked, so the application can flush the notifications it batched. */
+    virtual void on_decide_block(const block_t &) {}
 
     public:
     HotStuffBase(uint32_t blk_size,
@@ -322,6 +655,60 @@ class HotStuffBase: public HotStuffCore {
     void exec_command(uint256_t cmd_hash, commit_cb_t callback);
     void start(std::vector<std::tuple<NetAddr, pubkey_bt, uint256_t>> &&replicas,
                 double delta, bool ec_loop = false);
+    /** Prune the blocks more than `staleness` below the last committed one,
+     * at most `batch` blocks per event loop tick. A pruning starts once
+     * `interval` more blocks are committed (0 to disable) or once blk_cache
+     * exceeds `blk_cache_budget` bytes (0 for no budget). */
+    void set_prune_policy(uint32_t staleness, uint32_t interval,
+                        size_t blk_cache_budget, size_t batch = 64);
+    /** Let the block size vary within [blk_size_min, blk_size_max], growing
+     * while commands queue up and shrinking when the QC latency of its own
+     * blocks exceeds twice the lowest one seen or the queue is drained. A
+     * partial block is proposed once commands have waited `max_wait`
+     * seconds (0 to always wait for a full block). */
+    void set_batching(size_t blk_size_min, size_t blk_size_max, double max_wait);
+    /** Derive delta from the measured message delays instead of using the
+     * static one. A replica only samples the votes for the blocks it
+     * proposed: such a vote arrives a round trip after the proposal, which
+     * bounds the one-way delay from above; the other replicas keep their
+     * delta. The estimate is the `percentile` of the recent `window` samples
+     * of the slowest peer, times `factor`, clamped to [dmin, dmax]. Delta is
+     * raised as soon as a sample exceeds it, but only lowered once the
+     * estimate has stayed below it for `window` samples. */
+    void enable_adaptive_delta(double percentile, double factor,
+                            double dmin, double dmax, size_t window = 256);
+    /** Execute committed blocks on a dedicated thread, fed through a queue of
+     * `capacity` blocks. Command callbacks and on_decide_block() are still
+     * invoked on the event loop, after the execution of their block. The
+     * proposer stops proposing while `capacity` blocks wait for execution. */
+    void enable_executor(size_t capacity);
+    /** Propose blocks with short IDs in place of the command hashes. The
+     * other replicas fill them in from the commands they are waiting for
+     * and request the rest from the proposer. */
+    void enable_compact_proposal() { compact_proposal = true; }
+    /** Pack the votes, notifications, blames and fetch requests for the same
+     * peer into one message, sent at the next event loop iteration or once
+     * it reaches `threshold` bytes (0 to send them one by one). */
+    void enable_coalescing(size_t threshold) { coalesce_threshold = threshold; }
+    /** Instead of broadcasting the votes, send them up a `fanout`-ary tree
+     * over the replicas rooted at the proposer (a star once the fanout
+     * reaches the number of the other replicas). Each replica verifies the
+     * votes of its subtree and sends them to its parent as one bundle once
+     * all of them are in, or after `wait` seconds; if no QC comes back
+     * within `wait` per level plus one, it sends the bundle straight to the
+     * proposer. A replica still tells everyone the block it
+     * voted for, so conflicting proposals are noticed as with the broadcast.
+     * As only the proposer gets the votes, every replica relays a QC the
+     * first time it holds it and only commits a block 2 * delta after
+     * holding its QC (see HotStuffCore::set_commit_on_qc()). The fast-commit
+     * path stays with the proposer. 0 restores the broadcast. */
+    void set_vote_aggregation(size_t fanout, double wait) {
+        vote_fanout = fanout;
+        vote_agg_wait = wait;
+        set_commit_on_qc(fanout > 0);
+    }
+    /** Pin the verification threads to the given CPUs (round-robin). */
+    void set_worker_affinity(const std::vector<int> &cpus) { vpool.set_affinity(cpus); }
 
     size_t size() const { return peers.size(); }
     const auto &get_decision_waiting() const { return decision_waiting; }
@@ -359,6 +746,14 @@ class HotStuff: public HotStuffBase {
                     blk_hash);
     }
 
+    promise_t async_create_part_cert(const PrivKey &priv_key, const uint256_t &blk_hash) override {
+        HOTSTUFF_LOG_DEBUG("async create part cert with priv=%s, blk_hash=%s",
+                            get_hex10(priv_key).c_str(), get_hex10(blk_hash).c_str());
+        return vpool.verify_urgent(new SignTask<PartCertType, PrivKeyType>(
+                    static_cast<const PrivKeyType &>(priv_key),
+                    blk_hash));
+    }
+
     part_cert_bt parse_part_cert(DataStream &s) override {
         PartCert *pc = new PartCertType();
         s >> *pc;
@@ -410,6 +805,10 @@ class HotStuff: public HotStuffBase {
 using HotStuffNoSig = HotStuff<>;
 using HotStuffSecp256k1 = HotStuff<PrivKeySecp256k1, PubKeySecp256k1,
                                     PartCertSecp256k1, QuorumCertSecp256k1>;
+using HotStuffEd25519 = HotStuff<PrivKeyEd25519, PubKeyEd25519,
+                                    PartCertEd25519, QuorumCertEd25519>;
+using HotStuffSecp256k1HalfAgg = HotStuff<PrivKeySecp256k1, PubKeySecp256k1,
+                                    PartCertSchnorrSecp256k1, QuorumCertHalfAggSecp256k1>;
 
 template<EntityType ent_type>
 FetchContext<ent_type>::FetchContext(FetchContext && other):
@@ -455,7 +854,7 @@ FetchContext<ent_type>::FetchContext(
 template<EntityType ent_type>
 void FetchContext<ent_type>::send(const NetAddr &replica_id) {
     hs->part_fetched_replica[replica_id]++;
-    hs->pn.send_msg(fetch_msg, replica_id);
+    hs->send_coalesced(fetch_msg, replica_id);
 }
 
 template<EntityType ent_type>
@@ -18,6 +18,8 @@
 #ifndef _HOTSTUFF_LIVENESS_H
 #define _HOTSTUFF_LIVENESS_H
 
+#include <deque>
+
 #include "salticidae/util.h"
 #include "hotstuff/hotstuff.h"
 
@@ -64,11 +66,7 @@ class PMHighTail: public virtual PaceMaker {
     const int32_t parent_limit;         /**< maximum number of parents */
 
     bool check_ancestry(const block_t &_a, const block_t &_b) {
-        block_t b;
-        for (b = _b;
-            b->get_height() > _a->get_height();
-            b = b->get_parents()[0]);
-        return b == _a;
+        return _b->extends(*_a, hsc->get_pruned_height());
     }
     
     void reg_hqc_update() {
@@ -97,6 +95,14 @@ class PMHighTail: public virtual PaceMaker {
         });
     }
 
+    /* the uncertified blocks of the last view are abandoned */
+    void reg_view_change() {
+        hsc->async_wait_view_change().then([this](uint32_t) {
+            hqc_tail = hsc->get_hqc();
+            reg_view_change();
+        });
+    }
+
     public:
     PMHighTail(int32_t parent_limit): parent_limit(parent_limit) {}
     void init() {
@@ -104,6 +110,7 @@ class PMHighTail: public virtual PaceMaker {
         reg_hqc_update();
         reg_proposal();
         reg_receive_proposal();
+        reg_view_change();
     }
 
     std::vector<block_t> get_parents() override {
@@ -129,48 +136,70 @@ class PMHighTail: public virtual PaceMaker {
 
 /** Beat implementation for PaceMaker: simply wait for the QC of last proposed
  * block.  PaceMakers derived from this class will beat only when the last
- * block proposed by itself gets its QC. */
+ * block proposed by itself gets its QC, or, with a pipeline depth of k, when
+ * fewer than k of its proposed blocks are waiting for their QCs. */
 class PMWaitQC: public virtual PaceMaker {
     std::queue<promise_t> pending_beats;
-    block_t last_proposed;
+    /** blocks proposed by itself that are still waiting for their QCs */
+    std::deque<block_t> uncertified;
+    const size_t pipeline_depth;
     bool locked;
     promise_t pm_qc_finish;
     promise_t pm_wait_propose;
 
     protected:
     void schedule_next() {
-        if (!pending_beats.empty() && !locked)
+        if (pending_beats.empty() || locked) return;
+        locked = true;
+        if (uncertified.size() < pipeline_depth)
         {
             auto pm = pending_beats.front();
             pending_beats.pop();
-            pm_qc_finish.reject();
-            (pm_qc_finish = hsc->async_qc_finish(last_proposed))
-                .then([this, pm]() {
-                    pm.resolve(get_proposer());
-                });
-            locked = true;
+            pm.resolve(get_proposer());
+            return;
         }
+        pm_qc_finish.reject();
+        (pm_qc_finish = hsc->async_qc_finish(uncertified.front()))
+            .then([this, blk = uncertified.front()]() {
+                if (!uncertified.empty() && uncertified.front() == blk)
+                    uncertified.pop_front();
+                locked = false;
+                schedule_next();
+            });
     }
 
     void update_last_proposed() {
         pm_wait_propose.reject();
         (pm_wait_propose = hsc->async_wait_proposal()).then(
                 [this](const Proposal &prop) {
-            last_proposed = prop.blk;
+            uncertified.push_back(prop.blk);
             locked = false;
             schedule_next();
             update_last_proposed();
         });
     }
 
+    void reg_view_change() {
+        hsc->async_wait_view_change().then([this](uint32_t) {
+            pm_qc_finish.reject();
+            uncertified.clear();
+            locked = false;
+            schedule_next();
+            reg_view_change();
+        });
+    }
+
     public:
+    PMWaitQC(size_t pipeline_depth = 1):
+        pipeline_depth(std::max(pipeline_depth, (size_t)1)) {}
 
     size_t get_pending_size() override { return pending_beats.size(); }
 
     void init() {
-        last_proposed = hsc->get_genesis();
+        uncertified.clear();
         locked = false;
         update_last_proposed();
+        reg_view_change();
     }
 
     ReplicaID get_proposer() override {
@@ -193,8 +222,8 @@ class PMWaitQC: public virtual PaceMaker {
 
 /** Naive PaceMaker where everyone can be a proposer at any moment. */
 struct PaceMakerDummy: public PMHighTail, public PMWaitQC {
-    PaceMakerDummy(int32_t parent_limit):
-        PMHighTail(parent_limit), PMWaitQC() {}
+    PaceMakerDummy(int32_t parent_limit, size_t pipeline_depth = 1):
+        PMHighTail(parent_limit), PMWaitQC(pipeline_depth) {}
     void init(HotStuffCore *hsc) override {
         PaceMaker::init(hsc);
         PMHighTail::init();
@@ -208,8 +237,9 @@ class PaceMakerDummyFixed: public PaceMakerDummy {
 
     public:
     PaceMakerDummyFixed(ReplicaID proposer,
-                        int32_t parent_limit):
-        PaceMakerDummy(parent_limit),
+                        int32_t parent_limit,
+                        size_t pipeline_depth = 1):
+        PaceMakerDummy(parent_limit, pipeline_depth),
         proposer(proposer) {}
 
     ReplicaID get_proposer() override {
@@ -240,7 +270,9 @@ class PMRoundRobinProposer: virtual public PaceMaker {
 
     /* extra state needed for a proposer */
     std::queue<promise_t> pending_beats;
-    block_t last_proposed;
+    /** blocks proposed by itself that are still waiting for their QCs */
+    std::deque<block_t> uncertified;
+    const size_t pipeline_depth;
     bool locked;
     promise_t pm_qc_finish;
     promise_t pm_wait_propose;
@@ -263,31 +295,47 @@ class PMRoundRobinProposer: virtual public PaceMaker {
     }
 
     void proposer_schedule_next() {
-        if (!pending_beats.empty() && !locked)
+        if (pending_beats.empty() || locked) return;
+        locked = true;
+        if (uncertified.size() < pipeline_depth)
         {
             auto pm = pending_beats.front();
             pending_beats.pop();
-            pm_qc_finish.reject();
-            (pm_qc_finish = hsc->async_qc_finish(last_proposed))
-                .then([this, pm]() {
-                    HOTSTUFF_LOG_PROTO("got QC, propose a new block");
-                    pm.resolve(proposer);
-                });
-            locked = true;
+            pm.resolve(proposer);
+            return;
         }
+        pm_qc_finish.reject();
+        (pm_qc_finish = hsc->async_qc_finish(uncertified.front()))
+            .then([this, blk = uncertified.front()]() {
+                HOTSTUFF_LOG_PROTO("got QC, propose a new block");
+                if (!uncertified.empty() && uncertified.front() == blk)
+                    uncertified.pop_front();
+                locked = false;
+                proposer_schedule_next();
+            });
     }
 
     void proposer_update_last_proposed() {
         pm_wait_propose.reject();
         (pm_wait_propose = hsc->async_wait_proposal()).then(
                 [this](const Proposal &prop) {
-            last_proposed = prop.blk;
+            uncertified.push_back(prop.blk);
             locked = false;
             proposer_schedule_next();
             proposer_update_last_proposed();
         });
     }
 
+    void proposer_reg_view_change() {
+        hsc->async_wait_view_change().then([this](uint32_t) {
+            pm_qc_finish.reject();
+            uncertified.clear();
+            locked = false;
+            proposer_schedule_next();
+            proposer_reg_view_change();
+        });
+    }
+
     void do_new_consensus(int x, const std::vector<uint256_t> &cmds) {
         auto blk = hsc->on_propose(cmds, get_parents(), bytearray_t());
         pm_qc_manual.reject();
@@ -336,7 +384,7 @@ class PMRoundRobinProposer: virtual public PaceMaker {
         pm_qc_manual.reject();
         rotating = false;
         locked = false;
-        last_proposed = hsc->get_genesis();
+        uncertified.clear();
         proposer_update_last_proposed();
         if (proposer == hsc->get_id())
         {
@@ -370,16 +418,19 @@ class PMRoundRobinProposer: virtual public PaceMaker {
 
     public:
     PMRoundRobinProposer(const EventContext &ec,
-                        double base_timeout, double prop_delay):
+                        double base_timeout, double prop_delay,
+                        size_t pipeline_depth = 1):
         base_timeout(base_timeout),
         prop_delay(prop_delay),
-        ec(ec), proposer(0), rotating(false) {}
+        ec(ec), proposer(0), rotating(false),
+        pipeline_depth(std::max(pipeline_depth, (size_t)1)) {}
 
     size_t get_pending_size() override { return pending_beats.size(); }
 
     void init() {
         exp_timeout = base_timeout;
         stop_rotate();
+        proposer_reg_view_change();
     }
 
     ReplicaID get_proposer() override {
@@ -409,9 +460,10 @@ class PMRoundRobinProposer: virtual public PaceMaker {
 
 struct PaceMakerRR: public PMHighTail, public PMRoundRobinProposer {
     PaceMakerRR(EventContext ec, int32_t parent_limit,
-                double base_timeout = 1, double prop_delay = 1):
+                double base_timeout = 1, double prop_delay = 1,
+                size_t pipeline_depth = 1):
         PMHighTail(parent_limit),
-        PMRoundRobinProposer(ec, base_timeout, prop_delay) {}
+        PMRoundRobinProposer(ec, base_timeout, prop_delay, pipeline_depth) {}
 
     void init(HotStuffCore *hsc) override {
         PaceMaker::init(hsc);
@@ -17,99 +17,403 @@
 #ifndef _HOTSTUFF_WORKER_H
 #define _HOTSTUFF_WORKER_H
 
+#include <atomic>
+#include <cstring>
+#include <condition_variable>
+#include <deque>
+#include <functional>
+#include <mutex>
 #include <thread>
-#include <unordered_map>
 #include <unistd.h>
+#include <pthread.h>
 
 #include "salticidae/event.h"
 #include "hotstuff/util.h"
 
 namespace hotstuff {
 
+/** Recycles the memory of finished tasks, so that verification in the steady
+ * state does not go through the allocator. Tasks are created and destroyed by
+ * the thread owning the pool, hence the per-thread free lists. */
+class VeriTaskAllocator {
+    static const size_t unit = 64;
+    static const size_t nbucket = 16;
+    static const size_t max_free = 1024;
+
+    static std::vector<void *> *get_free_lists() {
+        static thread_local std::vector<void *> free_lists[nbucket];
+        return free_lists;
+    }
+
+    static size_t get_bucket(size_t size) { return (size + unit - 1) / unit - 1; }
+
+    public:
+    static void *alloc(size_t size) {
+        auto b = get_bucket(size);
+        if (b >= nbucket) return ::operator new(size);
+        auto &fl = get_free_lists()[b];
+        if (fl.empty()) return ::operator new((b + 1) * unit);
+        auto p = fl.back();
+        fl.pop_back();
+        return p;
+    }
+
+    static void free(void *p, size_t size) {
+        auto b = get_bucket(size);
+        if (b < nbucket)
+        {
+            auto &fl = get_free_lists()[b];
+            if (fl.size() < max_free)
+            {
+                fl.push_back(p);
+                return;
+            }
+        }
+        ::operator delete(p);
+    }
+};
+
 class VeriTask {
     friend class VeriPool;
     bool result;
+    uint32_t slot;  /**< index in the completion table of the pool */
     public:
+    static void *operator new(size_t size) { return VeriTaskAllocator::alloc(size); }
+    static void operator delete(void *p, size_t size) { VeriTaskAllocator::free(p, size); }
+
+    /** Do the work of the task; called by a worker thread. */
     virtual bool verify() = 0;
+    /** Resolve the promise of the task; called by the thread owning the pool
+     * once verify() has returned. */
+    virtual void settle(promise_t &pm) { pm.resolve(result); }
     virtual ~VeriTask() = default;
 };
 
 using salticidae::ThreadCall;
 using veritask_ut = BoxObj<VeriTask>;
-using mpmc_queue_t = salticidae::MPMCQueueEventDriven<VeriTask *>;
 using mpsc_queue_t = salticidae::MPSCQueueEventDriven<VeriTask *>;
 
+/** Runs tasks on a set of worker threads. Each worker has its own deque and
+ * steals from the others once it runs dry; an idle worker sleeps and is only
+ * woken up when there is new work, so a busy pool costs no wakeups. Urgent
+ * tasks (signing) go to a shared lane that every worker drains first, so they
+ * never wait behind a verification backlog. */
 class VeriPool {
-    mpmc_queue_t in_queue;
     mpsc_queue_t out_queue;
 
     struct Worker {
         std::thread handle;
-        EventContext ec;
-        BoxObj<ThreadCall> tcall;
+        std::mutex lock;
+        std::deque<VeriTask *> tasks;
+    };
+
+    struct Slot {
+        veritask_ut task;
+        promise_t pm;
     };
 
     std::vector<Worker> workers;
-    std::unordered_map<VeriTask *, std::pair<veritask_ut, promise_t>> pms;
+    /** the worker receiving the next task */
+    size_t next_worker;
+    /* tasks in flight, indexed by VeriTask::slot */
+    std::vector<Slot> slots;
+    std::vector<uint32_t> free_slots;
+    /* urgent tasks, shared by all workers */
+    std::mutex urgent_lock;
+    std::deque<VeriTask *> urgent_tasks;
+    /** kept apart from npending so that workers skip the lock when empty */
+    std::atomic<size_t> nurgent;
+    /* tasks not yet taken by any worker */
+    std::atomic<size_t> npending;
+    std::atomic<size_t> nidle;
+    std::atomic<bool> stopped;
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+
+    VeriTask *take(size_t i) {
+        if (nurgent > 0)
+        {
+            std::lock_guard<std::mutex> _(urgent_lock);
+            if (!urgent_tasks.empty())
+            {
+                VeriTask *task = urgent_tasks.front();
+                urgent_tasks.pop_front();
+                nurgent--;
+                npending--;
+                return task;
+            }
+        }
+        /* try the worker's own deque first, then steal from the others */
+        for (size_t j = 0; j < workers.size(); j++)
+        {
+            auto &w = workers[(i + j) % workers.size()];
+            std::lock_guard<std::mutex> _(w.lock);
+            if (w.tasks.empty()) continue;
+            VeriTask *task;
+            if (j == 0)
+            {
+                task = w.tasks.front();
+                w.tasks.pop_front();
+            }
+            else
+            {
+                task = w.tasks.back();
+                w.tasks.pop_back();
+            }
+            npending--;
+            return task;
+        }
+        return nullptr;
+    }
+
+    void worker_loop(size_t i) {
+        while (!stopped)
+        {
+            VeriTask *task = take(i);
+            if (task)
+            {
+                HOTSTUFF_LOG_DEBUG("%lx working on %u",
+                                    std::this_thread::get_id(), (uintptr_t)task);
+                task->result = task->verify();
+                out_queue.enqueue(task);
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(idle_lock);
+            nidle++;
+            idle_cv.wait(lk, [this]() { return stopped || npending > 0; });
+            nidle--;
+        }
+    }
 
     public:
-    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128) {
+    VeriPool(EventContext ec, size_t nworker, size_t burst_size = 128):
+            workers(std::max(nworker, (size_t)1)), next_worker(0),
+            nurgent(0), npending(0), nidle(0), stopped(false) {
         out_queue.reg_handler(ec, [this, burst_size](mpsc_queue_t &q) {
             size_t cnt = burst_size;
             VeriTask *task;
             while (q.try_dequeue(task))
             {
-                auto it = pms.find(task);
-                it->second.second.resolve(task->result);
-                pms.erase(it);
+                /* settle() may submit new tasks, so release the slot first */
+                auto &slot = slots[task->slot];
+                veritask_ut t = std::move(slot.task);
+                promise_t pm = std::move(slot.pm);
+                free_slots.push_back(task->slot);
+                task->settle(pm);
                 if (!--cnt) return true;
             }
             return false;
         });
 
-        workers.resize(nworker);
-        for (size_t i = 0; i < nworker; i++)
+        for (size_t i = 0; i < workers.size(); i++)
+            workers[i].handle = std::thread([this, i]() { worker_loop(i); });
+    }
+
+    ~VeriPool() {
         {
-            in_queue.reg_handler(workers[i].ec, [this, burst_size](mpmc_queue_t &q) {
-                size_t cnt = burst_size;
-                VeriTask *task;
-                while (q.try_dequeue(task))
-                {
-                    HOTSTUFF_LOG_DEBUG("%lx working on %u",
-                                        std::this_thread::get_id(), (uintptr_t)task);
-                    task->result = task->verify();
-                    out_queue.enqueue(task);
-                    if (!--cnt) return true;
-                }
-                return false;
-            });
+            std::lock_guard<std::mutex> _(idle_lock);
+            stopped = true;
         }
+        idle_cv.notify_all();
         for (auto &w: workers)
+            w.handle.join();
+    }
+
+    /** Pin worker i to cpus[i % cpus.size()]; each CPU should be in
+     * [0, CPU_SETSIZE). */
+    void set_affinity(const std::vector<int> &cpus) {
+        if (cpus.empty()) return;
+        for (size_t i = 0; i < workers.size(); i++)
         {
-            w.tcall = new ThreadCall(w.ec);
-            w.handle = std::thread([ec=w.ec]() { ec.dispatch(); });
+            int cpu = cpus[i % cpus.size()];
+            if (cpu < 0 || cpu >= CPU_SETSIZE)
+            {
+                HOTSTUFF_LOG_WARN("cpu %d out of range, verification worker %lu not pinned",
+                                    cpu, i);
+                continue;
+            }
+            cpu_set_t cpuset;
+            CPU_ZERO(&cpuset);
+            CPU_SET(cpu, &cpuset);
+            int err = pthread_setaffinity_np(workers[i].handle.native_handle(),
+                                            sizeof(cpu_set_t), &cpuset);
+            if (err)
+                HOTSTUFF_LOG_WARN("failed to pin verification worker %lu to cpu %d: %s",
+                                    i, cpu, strerror(err));
         }
     }
 
-    ~VeriPool() {
-        for (auto &w: workers)
-            w.tcall->async_call([ec=w.ec](ThreadCall::Handle &) {
-                ec.stop();
-            });
-        for (auto &w: workers)
-            w.handle.join();
-    }
+    size_t get_nworker() const { return workers.size(); }
 
-    promise_t verify(veritask_ut &&task) {
+    promise_t verify(veritask_ut &&task) { return submit(std::move(task), false); }
+
+    /** Run `task` ahead of all the queued verification work; used for the
+     * signatures of votes and blames, which are on the critical path. */
+    promise_t verify_urgent(veritask_ut &&task) { return submit(std::move(task), true); }
+
+    private:
+    promise_t submit(veritask_ut &&task, bool urgent) {
+        uint32_t idx;
+        if (free_slots.empty())
+        {
+            idx = slots.size();
+            slots.emplace_back();
+        }
+        else
+        {
+            idx = free_slots.back();
+            free_slots.pop_back();
+        }
         auto ptr = task.get();
-        auto ret = pms.insert(std::make_pair(ptr,
-                std::make_pair(std::move(task), promise_t([](promise_t &){}))));
-        assert(ret.second);
-        in_queue.enqueue(ptr);
-        return ret.first->second.second;
+        ptr->slot = idx;
+        auto &slot = slots[idx];
+        slot.task = std::move(task);
+        slot.pm = promise_t([](promise_t &){});
+        if (urgent)
+        {
+            std::lock_guard<std::mutex> _(urgent_lock);
+            urgent_tasks.push_back(ptr);
+            nurgent++;
+        }
+        else
+        {
+            auto &w = workers[next_worker];
+            next_worker = (next_worker + 1) % workers.size();
+            std::lock_guard<std::mutex> _(w.lock);
+            w.tasks.push_back(ptr);
+        }
+        npending++;
+        /* only pay for a wakeup when some worker is asleep */
+        if (nidle > 0)
+        {
+            std::lock_guard<std::mutex> _(idle_lock);
+            idle_cv.notify_one();
+        }
+        return slot.pm;
     }
 };
 
+/** A bounded lock-free queue with a single producer and a single consumer. */
+template<typename T>
+class SPSCQueue {
+    std::vector<T> elems;
+    size_t mask;
+    /* head is only written by the consumer, tail only by the producer */
+    alignas(64) std::atomic<size_t> head;
+    alignas(64) std::atomic<size_t> tail;
+
+    public:
+    SPSCQueue(size_t capacity): head(0), tail(0) {
+        size_t cap = 1;
+        while (cap < capacity) cap <<= 1;
+        elems.resize(cap);
+        mask = cap - 1;
+    }
+
+    bool try_enqueue(T &&e) {
+        size_t t = tail.load(std::memory_order_relaxed);
+        if (t - head.load(std::memory_order_acquire) > mask) return false;
+        elems[t & mask] = std::move(e);
+        tail.store(t + 1);
+        return true;
+    }
+
+    bool try_dequeue(T &e) {
+        size_t h = head.load(std::memory_order_relaxed);
+        if (h == tail.load(std::memory_order_acquire)) return false;
+        e = std::move(elems[h & mask]);
+        head.store(h + 1, std::memory_order_release);
+        return true;
+    }
+
+    bool empty() const { return head.load() == tail.load(); }
+    size_t get_capacity() const { return mask + 1; }
+};
+
+/** Runs a function on a dedicated thread over the elements submitted by the
+ * thread owning `ec`, in submission order, and hands each element back to
+ * that thread once done. */
+template<typename T>
+class Executor {
+    using exec_func_t = std::function<void(const T &)>;
+    using done_func_t = std::function<void(T &&)>;
+    using done_queue_t = salticidae::MPSCQueueEventDriven<T>;
+
+    SPSCQueue<T> in_queue;
+    done_queue_t out_queue;
+    exec_func_t exec_func;
+    /** the number of submitted elements not yet handed back */
+    size_t ninflight;
+    std::atomic<bool> sleeping;
+    std::atomic<bool> stopped;
+    std::mutex idle_lock;
+    std::condition_variable idle_cv;
+    std::thread handle;
+
+    void loop() {
+        T e;
+        while (!stopped)
+        {
+            if (in_queue.try_dequeue(e))
+            {
+                exec_func(e);
+                out_queue.enqueue(std::move(e));
+                continue;
+            }
+            std::unique_lock<std::mutex> lk(idle_lock);
+            sleeping = true;
+            idle_cv.wait(lk, [this]() { return stopped || !in_queue.empty(); });
+            sleeping = false;
+        }
+    }
+
+    public:
+    Executor(EventContext ec, size_t capacity,
+            exec_func_t exec_func, done_func_t done_func,
+            size_t burst_size = 128):
+            in_queue(capacity), exec_func(std::move(exec_func)),
+            ninflight(0), sleeping(false), stopped(false) {
+        out_queue.reg_handler(ec, [this, done_func = std::move(done_func), burst_size](done_queue_t &q) {
+            size_t cnt = burst_size;
+            T e;
+            while (q.try_dequeue(e))
+            {
+                ninflight--;
+                done_func(std::move(e));
+                if (!--cnt) return true;
+            }
+            return false;
+        });
+        handle = std::thread([this]() { loop(); });
+    }
+
+    ~Executor() {
+        {
+            std::lock_guard<std::mutex> _(idle_lock);
+            stopped = true;
+        }
+        idle_cv.notify_all();
+        handle.join();
+    }
+
+    /** Returns false if the queue is full. */
+    bool submit(const T &e) {
+        T _e = e;
+        if (!in_queue.try_enqueue(std::move(_e))) return false;
+        ninflight++;
+        /* only pay for a wakeup when the thread is asleep */
+        if (sleeping)
+        {
+            std::lock_guard<std::mutex> _(idle_lock);
+            idle_cv.notify_one();
+        }
+        return true;
+    }
+
+    size_t get_ninflight() const { return ninflight; }
+    size_t get_capacity() const { return in_queue.get_capacity(); }
+};
+
 }
 
 #endif
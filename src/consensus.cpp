@@ -15,7 +15,9 @@
  * limitations under the License.
  */
 
+#include <algorithm>
 #include <cassert>
+#include <limits>
 #include <stack>
 
 #include "hotstuff/util.h"
@@ -40,7 +42,9 @@ HotStuffCore::HotStuffCore(ReplicaID id,
         blame_qc(nullptr),
         priv_key(std::move(priv_key)),
         tails{b0},
+        pruned_height(0),
         vote_disabled(false),
+        commit_on_qc(false),
         id(id),
         storage(new EntityStorage()) {
     storage->add_blk(b0);
@@ -68,6 +72,8 @@ bool HotStuffCore::on_deliver_blk(const block_t &blk) {
     for (const auto &hash: blk->parent_hashes)
         blk->parents.push_back(get_delivered_blk(hash));
     blk->height = blk->parents[0]->height + 1;
+    blk->skip = blk->parents[0]->get_ancestor(
+            Block::get_skip_height(blk->height), pruned_height);
 
     if (blk->qc)
     {
@@ -95,54 +101,92 @@ void HotStuffCore::update_hqc(const block_t &_hqc, const quorum_cert_bt &qc) {
 }
 
 void HotStuffCore::check_commit(const block_t &blk) {
+    if (!blk->extends(*b_exec, pruned_height))
+        throw std::runtime_error("safety breached :( " +
+                                std::string(*blk) + " " +
+                                std::string(*b_exec));
     std::vector<block_t> commit_queue;
-    block_t b;
-    for (b = blk; b->height > b_exec->height; b = b->parents[0])
+    for (block_t b = blk; b != b_exec; b = b->parents[0])
     { /* TODO: also commit the uncles/aunts */
         commit_queue.push_back(b);
     }
-    if (b != b_exec)
-        throw std::runtime_error("safety breached :( " +
-                                std::string(*blk) + " " +
-                                std::string(*b_exec));
     for (auto it = commit_queue.rbegin(); it != commit_queue.rend(); it++)
     {
         const block_t &blk = *it;
         blk->decision = 1;
         do_consensus(blk);
         LOG_PROTO("commit %s", std::string(*blk).c_str());
-        for (size_t i = 0; i < blk->cmds.size(); i++)
-            do_decide(Finality(id, 1, i, blk->height,
-                                blk->cmds[i], blk->get_hash()));
+        do_decide_block(blk);
     }
     b_exec = blk;
+    truncate_height_state(b_exec->height);
+}
+
+void HotStuffCore::do_decide_block(const block_t &blk) {
+    for (size_t i = 0; i < blk->cmds.size(); i++)
+        do_decide(Finality(id, 1, i, blk->height,
+                            blk->cmds[i], blk->get_hash()));
+}
+
+bool HotStuffCore::is_finished_propose(const block_t &blk) const {
+    auto it = height_state.find(blk->height);
+    return it != height_state.end() && it->second.finished_propose.count(blk);
+}
+
+void HotStuffCore::truncate_height_state(uint32_t height) {
+    /* blocks up to b_exec are settled whether or not their QC was seen here,
+     * so release whoever is waiting for one; the promises are resolved only
+     * after the erase, as their callbacks may wait for another QC */
+    std::vector<promise_t> waiting;
+    auto end = height_state.upper_bound(height);
+    for (auto it = height_state.begin(); it != end; it++)
+    {
+        for (auto &p: it->second.qc_waiting)
+            waiting.push_back(std::move(p.second));
+        it->second.qc_waiting.clear();
+    }
+    height_state.erase(height_state.begin(), height_state.lower_bound(height));
+    for (auto &pm: waiting) pm.resolve();
 }
 
 // 2. Vote
 void HotStuffCore::_vote(const block_t &blk) {
     const auto &blk_hash = blk->get_hash();
     LOG_PROTO("vote for %s", get_hex10(blk_hash).c_str());
-    Vote vote(id, blk_hash,
-            create_part_cert(
-                *priv_key,
-                Vote::proof_obj_hash(blk_hash)), this);
+    /* the vote is signed off the event loop and sent once ready; drop it if a
+     * view transition begins in the meantime */
+    async_create_part_cert(*priv_key, Vote::proof_obj_hash(blk_hash))
+            .then([this, blk, v = view](const part_cert_t &cert) {
+        if (view_trans || view != v) return;
+        Vote vote(id, blk->get_hash(), cert->clone(), this);
 #ifndef SYNCHS_NOVOTEBROADCAST
-    on_receive_vote(vote);
+        on_receive_vote(vote);
 #endif
-    do_broadcast_vote(vote);
-    set_commit_timer(blk, 2 * config.delta);
+        do_broadcast_vote(vote);
+    });
+    if (commit_on_qc)
+    {
+        auto &hs = height_state[blk->height];
+        hs.self_voted.insert(blk);
+        /* the QC may have come first */
+        if (hs.qc_held.count(blk))
+            set_commit_timer(blk, 2 * config.delta);
+    }
+    else
+        set_commit_timer(blk, 2 * config.delta);
     //set_blame_timer(3 * config.delta);
 }
 
 // 3. Blame
 void HotStuffCore::_blame() {
     stop_blame_timer();
-    Blame blame(id, view,
-            create_part_cert(
-                *priv_key,
-                Blame::proof_obj_hash(view)), this);
-    on_receive_blame(blame);
-    do_broadcast_blame(blame);
+    async_create_part_cert(*priv_key, Blame::proof_obj_hash(view))
+            .then([this, v = view](const part_cert_t &cert) {
+        if (view_trans || view != v) return;
+        Blame blame(id, v, cert->clone(), this);
+        on_receive_blame(blame);
+        do_broadcast_blame(blame);
+    });
 }
 
 // i. New-view
@@ -158,6 +202,8 @@ void HotStuffCore::_new_view() {
     on_receive_blamenotify(bn);
     do_broadcast_blamenotify(bn);
     stop_commit_timer_all();
+    /* a vote of this view no longer leads to a commit */
+    for (auto &hs: height_state) hs.second.self_voted.clear();
     set_viewtrans_timer(2 * config.delta);
 }
 
@@ -189,7 +235,7 @@ block_t HotStuffCore::on_propose(const std::vector<uint256_t> &cmds,
     if (bnew->height <= vheight)
         throw std::runtime_error("new block should be higher than vheight");
     vheight = bnew->height;
-    finished_propose[bnew] = true;
+    height_state[bnew->height].finished_propose.insert(bnew);
     _vote(bnew);
     on_propose_(prop);
     /* boradcast to other replicas */
@@ -201,12 +247,14 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
     if (view_trans) return;
     LOG_PROTO("got %s", std::string(prop).c_str());
     block_t bnew = prop.blk;
-    if (finished_propose[bnew]) return;
+    /* stale: the bookkeeping for heights below b_exec is already dropped */
+    if (bnew->height < b_exec->height) return;
+    if (is_finished_propose(bnew)) return;
     sanity_check_delivered(bnew);
     if (bnew->qc_ref)
-        update_hqc(bnew->qc_ref, bnew->qc);
+        on_receive_qc(bnew->qc_ref, bnew->qc);
     bool opinion = false;
-    auto &pslot = proposals[bnew->height];
+    auto &pslot = height_state[bnew->height].proposals;
     if (pslot.size() <= 1)
     {
         pslot.insert(bnew);
@@ -222,12 +270,7 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
 
     if (opinion)
     {
-        block_t pref = hqc.first;
-        block_t b;
-        for (b = bnew;
-            b->height > pref->height;
-            b = b->parents[0]);
-        if (b == pref) /* on the same branch */
+        if (bnew->extends(*hqc.first, pruned_height)) /* on the same branch */
             vheight = bnew->height;
         else
             opinion = false;
@@ -235,7 +278,7 @@ void HotStuffCore::on_receive_proposal(const Proposal &prop) {
     LOG_PROTO("now state: %s", std::string(*this).c_str());
     if (bnew->qc_ref)
         on_qc_finish(bnew->qc_ref);
-    finished_propose[bnew] = true;
+    height_state[bnew->height].finished_propose.insert(bnew);
     on_receive_proposal_(prop);
     // check if the proposal extends the highest certified block
     if (opinion && !vote_disabled) _vote(bnew);
@@ -246,7 +289,7 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
     LOG_PROTO("now state: %s", std::string(*this).c_str());
     block_t blk = get_delivered_blk(vote.blk_hash);
     assert(vote.cert);
-    if (!finished_propose[blk])
+    if (!is_finished_propose(blk))
     {
         // FIXME: fill voter as proposer as a quickfix here, may be inaccurate
         // for some PaceMakers
@@ -254,12 +297,15 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
         on_receive_proposal(Proposal(vote.voter, blk, nullptr));
     }
     size_t qsize = blk->voted.size();
-    if (qsize >= config.nmajority) return;
+    if (qsize >= std::max(config.nmajority, config.nfast)) return;
     if (!blk->voted.insert(vote.voter).second)
     {
         LOG_WARN("duplicate vote for %s from %d", get_hex10(vote.blk_hash).c_str(), vote.voter);
         return;
     }
+    /* the votes beyond the majority only count towards the fast quorum */
+    if (qsize + 1 == config.nfast) on_fast_quorum(blk);
+    if (qsize >= config.nmajority) return;
     auto &qc = blk->self_qc;
     if (qc == nullptr)
     {
@@ -269,14 +315,52 @@ void HotStuffCore::on_receive_vote(const Vote &vote) {
     if (qsize + 1 == config.nmajority)
     {
         qc->compute();
-        update_hqc(blk, qc);
+        on_receive_qc(blk, qc);
         on_qc_finish(blk);
     }
 }
 
+void HotStuffCore::on_fast_quorum(const block_t &blk) {
+    if (view_trans || blk->parents.empty()) return;
+    /* votes may arrive out of order, so blk is either the successor of a
+     * block having a fast quorum, or such a block itself */
+    const auto &pblk = blk->parents[0];
+    if (pblk->voted.size() >= config.nfast)
+        fast_commit(pblk);
+    auto it = height_state.find(blk->height + 1);
+    if (it == height_state.end()) return;
+    for (const auto &b: it->second.finished_propose)
+        if (b->parents[0] == blk && b->voted.size() >= config.nfast)
+        {
+            fast_commit(blk);
+            return;
+        }
+}
+
+void HotStuffCore::fast_commit(const block_t &blk) {
+    if (blk->decision) return;
+    LOG_PROTO("fast commit %s", std::string(*blk).c_str());
+    uint32_t height = b_exec->height;
+    check_commit(blk);
+    /* the commit timers for these heights are no longer needed */
+    for (height++; height <= blk->height; height++)
+        stop_commit_timer(height);
+}
+
 void HotStuffCore::on_receive_notify(const Notify &notify) {
     block_t blk = get_delivered_blk(notify.blk_hash);
-    update_hqc(blk, notify.qc);
+    on_receive_qc(blk, notify.qc);
+}
+
+void HotStuffCore::on_receive_qc(const block_t &blk, const quorum_cert_bt &qc) {
+    update_hqc(blk, qc);
+    if (!commit_on_qc || blk->height < b_exec->height) return;
+    auto &hs = height_state[blk->height];
+    if (!hs.qc_held.insert(blk).second) return;
+    /* everyone holds the QC within delta of this replica, before it commits */
+    do_broadcast_qc(Notify(blk->get_hash(), qc->clone(), this));
+    if (hs.self_voted.count(blk) && !view_trans)
+        set_commit_timer(blk, 2 * config.delta);
 }
 
 void HotStuffCore::on_receive_blame(const Blame &blame) {
@@ -300,7 +384,20 @@ void HotStuffCore::on_receive_blamenotify(const BlameNotify &bn) {
     _new_view();
 }
 
-void HotStuffCore::on_commit_timeout(const block_t &blk) { check_commit(blk); }
+void HotStuffCore::on_commit_timeout(const block_t &blk) {
+    /* already committed by the fast path */
+    if (blk->decision) return;
+    check_commit(blk);
+}
+
+void HotStuffCore::on_commit_timeout(std::vector<block_t> &blks) {
+    /* committing the highest block commits its ancestors as well */
+    std::sort(blks.begin(), blks.end(), [](const block_t &a, const block_t &b) {
+        return a->height > b->height;
+    });
+    for (const auto &blk: blks)
+        on_commit_timeout(blk);
+}
 
 void HotStuffCore::on_blame_timeout() {
     LOG_INFO("no progress, start blaming");
@@ -311,7 +408,7 @@ void HotStuffCore::on_viewtrans_timeout() {
     // view change
     view++;
     view_trans = false;
-    proposals.clear();
+    for (auto &hs: height_state) hs.second.proposals.clear();
     blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
     blamed.clear();
     set_blame_timer(3 * config.delta);
@@ -325,6 +422,10 @@ void HotStuffCore::on_viewtrans_timeout() {
 /*** end HotStuff protocol logic ***/
 void HotStuffCore::on_init(uint32_t nfaulty, double delta) {
     config.nmajority = config.nreplicas - nfaulty;
+    /* a responsive commit is only safe with more than 3n/4 votes */
+    if (config.nfast)
+        config.nfast = std::min(std::max(config.nfast, config.nreplicas * 3 / 4 + 1),
+                                config.nreplicas);
     config.delta = delta;
     blame_qc = create_quorum_cert(Blame::proof_obj_hash(view));
     b0->qc = create_quorum_cert(Vote::proof_obj_hash(b0->get_hash()));
@@ -335,26 +436,48 @@ void HotStuffCore::on_init(uint32_t nfaulty, double delta) {
 }
 
 void HotStuffCore::prune(uint32_t staleness) {
+    prune_begin(staleness);
+    while (prune_step(std::numeric_limits<size_t>::max()));
+}
+
+bool HotStuffCore::prune_begin(uint32_t staleness, const block_t &top) {
+    if (!prune_stack.empty()) return false;
+    /* retry the blocks that were still referenced by the last pruning */
+    for (size_t n = prune_deferred.size(); n; n--)
+    {
+        auto d = std::move(prune_deferred.front());
+        prune_deferred.pop_front();
+        if (!storage->try_release_blk(d.first) && --d.second)
+            prune_deferred.push_back(std::move(d));
+    }
     block_t start;
     /* skip the blocks */
-    for (start = b_exec; staleness; staleness--, start = start->parents[0])
-        if (!start->parents.size()) return;
-    std::stack<block_t> s;
+    for (start = top ? top : b_exec; staleness; staleness--, start = start->parents[0])
+        if (!start->parents.size()) return false;
+    if (start->parents.empty()) return false;
     start->qc_ref = nullptr;
-    s.push(start);
-    while (!s.empty())
+    pruned_height = start->height;
+    prune_stack.push(start);
+    return true;
+}
+
+bool HotStuffCore::prune_step(size_t quota) {
+    for (; !prune_stack.empty() && quota; quota--)
     {
-        auto &blk = s.top();
+        auto &blk = prune_stack.top();
         if (blk->parents.empty())
         {
-            storage->try_release_blk(blk);
-            s.pop();
+            if (!storage->try_release_blk(blk) && blk != b0)
+                prune_deferred.push_back(std::make_pair(blk, prune_max_retry));
+            prune_stack.pop();
             continue;
         }
         blk->qc_ref = nullptr;
-        s.push(blk->parents.back());
+        blk->skip = nullptr;
+        prune_stack.push(blk->parents.back());
         blk->parents.pop_back();
     }
+    return !prune_stack.empty();
 }
 
 void HotStuffCore::add_replica(ReplicaID rid, const NetAddr &addr,
@@ -365,10 +488,13 @@ void HotStuffCore::add_replica(ReplicaID rid, const NetAddr &addr,
 }
 
 promise_t HotStuffCore::async_qc_finish(const block_t &blk) {
-    if (blk->voted.size() >= config.nmajority)
+    /* nothing would resolve the wait for a height truncated already */
+    if (blk->voted.size() >= config.nmajority ||
+        blk->height <= b_exec->height)
         return promise_t([](promise_t &pm) {
             pm.resolve();
         });
+    auto &qc_waiting = height_state[blk->height].qc_waiting;
     auto it = qc_waiting.find(blk);
     if (it == qc_waiting.end())
         it = qc_waiting.insert(std::make_pair(blk, promise_t())).first;
@@ -376,6 +502,9 @@ promise_t HotStuffCore::async_qc_finish(const block_t &blk) {
 }
 
 void HotStuffCore::on_qc_finish(const block_t &blk) {
+    auto hs = height_state.find(blk->height);
+    if (hs == height_state.end()) return;
+    auto &qc_waiting = hs->second.qc_waiting;
     auto it = qc_waiting.find(blk);
     if (it != qc_waiting.end())
     {
@@ -19,8 +19,85 @@
 
 namespace hotstuff {
 
-secp256k1_context_t secp256k1_default_sign_ctx = new Secp256k1Context(true);
-secp256k1_context_t secp256k1_default_verify_ctx = new Secp256k1Context(false);
+VerifiedSigCache verified_sig_cache;
+
+bool VerifiedSigCache::lookup(const uint256_t &key, uint256_t *value) {
+    auto &shard = get_shard(key);
+    bool found;
+    {
+        std::lock_guard<std::mutex> _(shard.lock);
+        auto it = shard.entries.find(key);
+        found = it != shard.entries.end();
+        if (found && value) *value = it->second;
+    }
+    (found ? nhit : nmiss).fetch_add(1, std::memory_order_relaxed);
+    return found;
+}
+
+void VerifiedSigCache::insert(const uint256_t &key, const uint256_t &value) {
+    auto &shard = get_shard(key);
+    std::lock_guard<std::mutex> _(shard.lock);
+    if (!shard.entries.insert(std::make_pair(key, value)).second) return;
+    shard.fifo.push(key);
+    if (shard.fifo.size() > shard_capacity)
+    {
+        shard.entries.erase(shard.fifo.front());
+        shard.fifo.pop();
+    }
+}
+
+/* Check the signatures of a quorum certificate with the pool. Signatures
+ * already in verified_sig_cache (see SigType::is_cached()) are skipped; the
+ * rest are split evenly into at most one batch per worker, while keeping
+ * each batch large enough to amortize the queueing cost. */
+template<typename QuorumVeriTaskType, typename PubKeyType, typename SigType>
+static promise_t verify_quorum(const uint256_t &obj_hash,
+                                const salticidae::Bits &rids,
+                                std::unordered_map<ReplicaID, SigType> &sigs,
+                                const ReplicaConfig &config,
+                                VeriPool &vpool, size_t chunk_min) {
+    std::vector<std::pair<ReplicaID, uint256_t>> pending;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+        {
+            HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
+                                i, get_hex10(obj_hash).c_str());
+            auto key = sigs[i].get_cache_key(obj_hash,
+                    static_cast<const PubKeyType &>(config.get_pubkey(i)));
+            if (!sigs[i].is_cached(key))
+                pending.push_back(std::make_pair(i, key));
+        }
+    if (pending.empty())
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    size_t nchunk = std::max((size_t)1, std::min(vpool.get_nworker(),
+                        pending.size() / chunk_min));
+    size_t chunk_size = (pending.size() + nchunk - 1) / nchunk;
+    std::vector<promise_t> vpm;
+    QuorumVeriTaskType *task = nullptr;
+    for (const auto &p: pending)
+    {
+        if (task == nullptr)
+        {
+            task = new QuorumVeriTaskType(obj_hash);
+            task->reserve(chunk_size);
+        }
+        task->add(static_cast<const PubKeyType &>(config.get_pubkey(p.first)),
+                sigs[p.first], p.second);
+        if (task->size() == chunk_size)
+        {
+            vpm.push_back(vpool.verify(task));
+            task = nullptr;
+        }
+    }
+    if (task) vpm.push_back(vpool.verify(task));
+    /* the common case: the whole QC is checked by a single task */
+    if (vpm.size() == 1) return std::move(vpm[0]);
+    return promise::all(vpm).then([](const promise::values_t &values) {
+        for (const auto &v: values)
+            if (!promise::any_cast<bool>(v)) return false;
+        return true;
+    });
+}
 
 QuorumCertSecp256k1::QuorumCertSecp256k1(
         const ReplicaConfig &config, const uint256_t &obj_hash):
@@ -35,10 +112,13 @@ bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
         {
             HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
                                 i, get_hex10(obj_hash).c_str());
-            if (!sigs[i].verify(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            secp256k1_default_verify_ctx))
-            return false;
+            const auto &pk = static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i));
+            const auto &sig = sigs[i];
+            auto key = sig.get_cache_key(obj_hash, pk);
+            if (verified_sig_cache.lookup(key)) continue;
+            if (!sig.verify(obj_hash, pk))
+                return false;
+            verified_sig_cache.insert(key);
         }
     return true;
 }
@@ -46,21 +126,318 @@ bool QuorumCertSecp256k1::verify(const ReplicaConfig &config) {
 promise_t QuorumCertSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpool) {
     if (sigs.size() < config.nmajority)
         return promise_t([](promise_t &pm) { pm.resolve(false); });
-    std::vector<promise_t> vpm;
+    return verify_quorum<Secp256k1QuorumVeriTask, PubKeySecp256k1>(
+            obj_hash, rids, sigs, config, vpool, verify_chunk_min);
+}
+
+promise_t QuorumCertSecp256k1::verify_parts(const ReplicaConfig &config, VeriPool &vpool) {
+    return verify_quorum<Secp256k1QuorumVeriTask, PubKeySecp256k1>(
+            obj_hash, rids, sigs, config, vpool, verify_chunk_min);
+}
+
+QuorumCertEd25519::QuorumCertEd25519(
+        const ReplicaConfig &config, const uint256_t &obj_hash):
+            QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas) {
+    rids.clear();
+}
+
+bool QuorumCertEd25519::verify(const ReplicaConfig &config) {
+    if (sigs.size() < config.nmajority) return false;
     for (size_t i = 0; i < rids.size(); i++)
         if (rids.get(i))
         {
             HOTSTUFF_LOG_DEBUG("checking cert(%d), obj_hash=%s",
                                 i, get_hex10(obj_hash).c_str());
-            vpm.push_back(vpool.verify(new Secp256k1VeriTask(obj_hash,
-                            static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i)),
-                            sigs[i])));
+            const auto &pk = static_cast<const PubKeyEd25519 &>(config.get_pubkey(i));
+            const auto &sig = sigs[i];
+            auto key = sig.get_cache_key(obj_hash, pk);
+            if (verified_sig_cache.lookup(key)) continue;
+            if (!sig.verify(obj_hash, pk))
+                return false;
+            verified_sig_cache.insert(key);
         }
-    return promise::all(vpm).then([](const promise::values_t &values) {
+    return true;
+}
+
+promise_t QuorumCertEd25519::verify(const ReplicaConfig &config, VeriPool &vpool) {
+    if (sigs.size() < config.nmajority)
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    return verify_quorum<Ed25519QuorumVeriTask, PubKeyEd25519>(
+            obj_hash, rids, sigs, config, vpool, verify_chunk_min);
+}
+
+promise_t QuorumCertEd25519::verify_parts(const ReplicaConfig &config, VeriPool &vpool) {
+    return verify_quorum<Ed25519QuorumVeriTask, PubKeyEd25519>(
+            obj_hash, rids, sigs, config, vpool, verify_chunk_min);
+}
+
+void SigSchnorrSecp256k1::put_point(DataStream &s, const secp256k1_pubkey &p) {
+    uint8_t output[_olen];
+    size_t olen = _olen;
+    (void)secp256k1_ec_pubkey_serialize(
+            Secp256k1Context::get(), (unsigned char *)output,
+            &olen, &p, SECP256K1_EC_COMPRESSED);
+    s.put_data(output, output + _olen);
+}
+
+bool SigSchnorrSecp256k1::point_eq(const secp256k1_pubkey &a, const secp256k1_pubkey &b) {
+    DataStream sa, sb;
+    put_point(sa, a);
+    put_point(sb, b);
+    return memcmp(sa.data(), sb.data(), sa.size()) == 0;
+}
+
+bool SigSchnorrSecp256k1::get_challenge(uint8_t *e, const secp256k1_pubkey &r,
+                            const secp256k1_pubkey &x, const uint256_t &msg) {
+    DataStream s;
+    put_point(s, r);
+    put_point(s, x);
+    s << msg;
+    bytearray_t h = s.get_hash();
+    memmove(e, &*h.begin(), nbytes);
+    /* e must be a valid non-zero scalar (fails with negligible probability) */
+    return secp256k1_ec_seckey_verify(Secp256k1Context::get(), e);
+}
+
+void SigSchnorrSecp256k1::sign(const uint256_t &msg, const PrivKeySecp256k1 &priv_key) {
+    auto ctx = Secp256k1Context::get();
+    secp256k1_pubkey x;
+    if (!secp256k1_ec_pubkey_create(ctx, &x, priv_key.data))
+        throw std::invalid_argument("invalid secp256k1 private key");
+    for (uint32_t i = 0;; i++)
+    {
+        /* derive the nonce deterministically from the key and the message */
+        DataStream s;
+        s.put_data(priv_key.data, priv_key.data + nbytes);
+        s << msg << i;
+        bytearray_t k = s.get_hash();
+        uint8_t e[nbytes];
+        if (!secp256k1_ec_pubkey_create(ctx, &r, &*k.begin()) ||
+            !get_challenge(e, r, x, msg))
+            continue;
+        memmove(s_data, priv_key.data, nbytes);
+        if (secp256k1_ec_privkey_tweak_mul(ctx, s_data, e) &&
+            secp256k1_ec_privkey_tweak_add(ctx, s_data, &*k.begin()))
+            return;
+    }
+}
+
+bool SigSchnorrSecp256k1::verify(const uint256_t &msg, const PubKeySecp256k1 &pub_key) const {
+    uint8_t e[nbytes];
+    secp256k1_pubkey lhs, rhs, ex = pub_key.data;
+    if (!get_challenge(e, r, pub_key.data, msg) ||
+        !secp256k1_ec_pubkey_create(Secp256k1Context::get(), &lhs, s_data) ||
+        !secp256k1_ec_pubkey_tweak_mul(Secp256k1Context::get(), &ex, e))
+        return false;
+    const secp256k1_pubkey *ins[] = {&r, &ex};
+    if (!secp256k1_ec_pubkey_combine(Secp256k1Context::get(), &rhs, ins, 2))
+        return false;
+    return point_eq(lhs, rhs);
+}
+
+uint256_t SigSchnorrSecp256k1::get_cache_key(const uint256_t &msg, const PubKeySecp256k1 &pub_key) const {
+    DataStream s;
+    s.put_data(pub_key.data.data, pub_key.data.data + sizeof(pub_key.data.data));
+    s << msg;
+    s.put_data(r.data, r.data + sizeof(r.data));
+    return s.get_hash();
+}
+
+bool SigSchnorrSecp256k1::aggregate(uint8_t *agg_s,
+                                    const std::vector<bytearray_t> &coeffs,
+                                    const std::vector<uint256_t> &ss) {
+    auto ctx = Secp256k1Context::get();
+    if (ss.empty() || ss.size() != coeffs.size()) return false;
+    for (size_t i = 0; i < ss.size(); i++)
+    {
+        bytearray_t t = ss[i];
+        if (!secp256k1_ec_privkey_tweak_mul(ctx, &*t.begin(), &*coeffs[i].begin()))
+            return false;
+        if (i == 0)
+            memmove(agg_s, &*t.begin(), nbytes);
+        else if (!secp256k1_ec_privkey_tweak_add(ctx, agg_s, &*t.begin()))
+            return false;
+    }
+    return true;
+}
+
+bool SigSchnorrSecp256k1::sum_terms(secp256k1_pubkey &sum, const uint256_t &msg,
+                                    const std::vector<agg_entry_t> &entries,
+                                    const std::vector<bytearray_t> &coeffs) {
+    auto ctx = Secp256k1Context::get();
+    if (entries.empty() || entries.size() != coeffs.size()) return false;
+    std::vector<secp256k1_pubkey> terms(entries.size());
+    std::vector<const secp256k1_pubkey *> ins;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        const auto &r = entries[i].second;
+        uint8_t e[nbytes];
+        secp256k1_pubkey ex = entries[i].first->data;
+        if (!get_challenge(e, r, entries[i].first->data, msg) ||
+            !secp256k1_ec_pubkey_tweak_mul(ctx, &ex, e))
+            return false;
+        const secp256k1_pubkey *pair[] = {&r, &ex};
+        if (!secp256k1_ec_pubkey_combine(ctx, &terms[i], pair, 2) ||
+            !secp256k1_ec_pubkey_tweak_mul(ctx, &terms[i], &*coeffs[i].begin()))
+            return false;
+        ins.push_back(&terms[i]);
+    }
+    return secp256k1_ec_pubkey_combine(ctx, &sum, ins.data(), ins.size());
+}
+
+bool SigSchnorrSecp256k1::check_sum(const uint8_t *s,
+                                    const std::vector<secp256k1_pubkey> &parts) {
+    auto ctx = Secp256k1Context::get();
+    std::vector<const secp256k1_pubkey *> ins;
+    for (const auto &p: parts) ins.push_back(&p);
+    secp256k1_pubkey lhs, rhs;
+    if (ins.empty() ||
+        !secp256k1_ec_pubkey_combine(ctx, &rhs, ins.data(), ins.size()) ||
+        !secp256k1_ec_pubkey_create(ctx, &lhs, s))
+        return false;
+    return point_eq(lhs, rhs);
+}
+
+QuorumCertHalfAggSecp256k1::QuorumCertHalfAggSecp256k1(
+        const ReplicaConfig &config, const uint256_t &obj_hash):
+            QuorumCert(), obj_hash(obj_hash), rids(config.nreplicas) {
+    rids.clear();
+    memset(agg_s, 0, sizeof agg_s);
+}
+
+/* a_i = H(L || i), where L commits to the message, the signer set and all
+ * the R's, so that no signer can cancel out the others' contributions. */
+bool QuorumCertHalfAggSecp256k1::get_agg_coeffs(std::vector<bytearray_t> &coeffs) const {
+    DataStream s;
+    s << obj_hash << rids;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i)) sigs.at(i).serialize_nonce(s);
+    uint256_t l = s.get_hash();
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+        {
+            DataStream c;
+            c << l << (uint32_t)i;
+            bytearray_t a = c.get_hash();
+            if (!secp256k1_ec_seckey_verify(
+                    Secp256k1Context::get(), &*a.begin()))
+                return false;
+            coeffs.push_back(std::move(a));
+        }
+    return true;
+}
+
+void QuorumCertHalfAggSecp256k1::compute() {
+    std::vector<bytearray_t> coeffs;
+    std::vector<uint256_t> ss;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i)) ss.push_back(sigs.at(i).get_s());
+    if (!get_agg_coeffs(coeffs) ||
+        !SigSchnorrSecp256k1::aggregate(agg_s, coeffs, ss))
+        memset(agg_s, 0, sizeof agg_s); /* never verifies */
+}
+
+/* Partial signatures verified before (as votes) have their s_i in
+ * verified_sig_cache, so their share of the aggregate is subtracted with
+ * scalar arithmetic only. On return, `entries` and `coeffs` are left with the
+ * other signers, for which rest * G == sum(a_i * (R_i + e_i * X_i)) still has
+ * to be checked. Returns false if the certificate is already known to be
+ * invalid. */
+bool QuorumCertHalfAggSecp256k1::split_cached(const ReplicaConfig &config,
+                    std::vector<bytearray_t> &coeffs,
+                    std::vector<SigSchnorrSecp256k1::agg_entry_t> &entries,
+                    uint8_t *rest) const {
+    auto ctx = Secp256k1Context::get();
+    std::vector<bytearray_t> cached_coeffs, pending_coeffs;
+    std::vector<uint256_t> ss;
+    size_t j = 0;
+    for (size_t i = 0; i < rids.size(); i++)
+        if (rids.get(i))
+        {
+            const auto &pk = static_cast<const PubKeySecp256k1 &>(config.get_pubkey(i));
+            const auto &sig = sigs.at(i);
+            uint256_t s;
+            if (verified_sig_cache.lookup(sig.get_cache_key(obj_hash, pk), &s))
+            {
+                ss.push_back(s);
+                cached_coeffs.push_back(std::move(coeffs[j++]));
+            }
+            else
+            {
+                entries.push_back(std::make_pair(&pk, sig.get_nonce()));
+                pending_coeffs.push_back(std::move(coeffs[j++]));
+            }
+        }
+    coeffs = std::move(pending_coeffs);
+    memmove(rest, agg_s, sizeof agg_s);
+    if (ss.empty()) return true;
+    uint8_t cached[sizeof agg_s];
+    if (!SigSchnorrSecp256k1::aggregate(cached, cached_coeffs, ss))
+        return false;
+    if (entries.empty())
+        return memcmp(cached, agg_s, sizeof agg_s) == 0;
+    /* a zero remainder cannot open to the terms of the uncached signers */
+    return secp256k1_ec_privkey_negate(ctx, cached) &&
+            secp256k1_ec_privkey_tweak_add(ctx, rest, cached);
+}
+
+bool QuorumCertHalfAggSecp256k1::verify(const ReplicaConfig &config) {
+    std::vector<bytearray_t> coeffs;
+    std::vector<SigSchnorrSecp256k1::agg_entry_t> entries;
+    uint8_t rest[sizeof agg_s];
+    if (sigs.size() < config.nmajority || !get_agg_coeffs(coeffs) ||
+        !split_cached(config, coeffs, entries, rest))
+        return false;
+    if (entries.empty()) return true;
+    std::vector<secp256k1_pubkey> parts(1);
+    return SigSchnorrSecp256k1::sum_terms(parts[0], obj_hash, entries, coeffs) &&
+            SigSchnorrSecp256k1::check_sum(rest, parts);
+}
+
+/* The uncached signers are split into at most one chunk per worker, as in
+ * verify_quorum(); each chunk yields a partial sum and the final comparison
+ * against rest * G is done once all of them are in. */
+promise_t QuorumCertHalfAggSecp256k1::verify(const ReplicaConfig &config, VeriPool &vpool) {
+    std::vector<bytearray_t> coeffs;
+    std::vector<SigSchnorrSecp256k1::agg_entry_t> entries;
+    bytearray_t rest(sizeof agg_s);
+    if (sigs.size() < config.nmajority || !get_agg_coeffs(coeffs) ||
+        !split_cached(config, coeffs, entries, &*rest.begin()))
+        return promise_t([](promise_t &pm) { pm.resolve(false); });
+    if (entries.empty())
+        return promise_t([](promise_t &pm) { pm.resolve(true); });
+    size_t nchunk = std::max((size_t)1, std::min(vpool.get_nworker(),
+                        entries.size() / verify_chunk_min));
+    size_t chunk_size = (entries.size() + nchunk - 1) / nchunk;
+    nchunk = (entries.size() + chunk_size - 1) / chunk_size;
+    auto parts = std::make_shared<std::vector<secp256k1_pubkey>>(nchunk);
+    std::vector<promise_t> vpm;
+    Secp256k1HalfAggVeriTask *task = nullptr;
+    for (size_t i = 0; i < entries.size(); i++)
+    {
+        if (task == nullptr)
+        {
+            task = new Secp256k1HalfAggVeriTask(obj_hash, parts, vpm.size());
+            task->reserve(chunk_size);
+        }
+        task->add(entries[i], std::move(coeffs[i]));
+        if (task->size() == chunk_size)
+        {
+            vpm.push_back(vpool.verify(task));
+            task = nullptr;
+        }
+    }
+    if (task) vpm.push_back(vpool.verify(task));
+    return promise::all(vpm).then([parts, rest](const promise::values_t &values) {
         for (const auto &v: values)
             if (!promise::any_cast<bool>(v)) return false;
-        return true;
+        return SigSchnorrSecp256k1::check_sum(&*rest.begin(), *parts);
     });
 }
 
+promise_t QuorumCertHalfAggSecp256k1::verify_parts(const ReplicaConfig &config, VeriPool &vpool) {
+    return verify_quorum<SchnorrSecp256k1QuorumVeriTask, PubKeySecp256k1>(
+            obj_hash, rids, sigs, config, vpool, verify_chunk_min);
+}
+
 }
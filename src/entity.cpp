@@ -21,12 +21,21 @@
 namespace hotstuff {
 
 void Block::serialize(DataStream &s) const {
+    if (serialized)
+    {
+        s.put_data(serialized->data(), serialized->data() + serialized->size());
+        return;
+    }
     s << htole((uint32_t)parent_hashes.size());
     for (const auto &hash: parent_hashes)
         s << hash;
     s << htole((uint32_t)cmds.size());
     for (auto cmd: cmds)
         s << cmd;
+    serialize_tail(s);
+}
+
+void Block::serialize_tail(DataStream &s) const {
     if (qc)
         s << (uint8_t)1 << *qc << qc_ref_hash;
     else
@@ -35,8 +44,10 @@ void Block::serialize(DataStream &s) const {
 }
 
 void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
+    /* the wire bytes are kept as the serialized block rather than
+     * serializing the parsed one again */
+    const uint8_t *begin = s.data();
     uint32_t n;
-    uint8_t flag;
     s >> n;
     n = letoh(n);
     parent_hashes.resize(n);
@@ -49,7 +60,18 @@ void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
         s >> cmd;
 //    for (auto &cmd: cmds)
 //        cmd = hsc->parse_cmd(s);
+    unserialize_tail(s, hsc);
+    set_serialized(begin, s.data());
+}
+
+void Block::unserialize_tail(DataStream &s, HotStuffCore *hsc) {
+    uint32_t n;
+    uint8_t flag;
     s >> flag;
+    /* the hash covers the wire bytes, so only the canonical encoding is
+     * accepted: a block is then relayed under the hash it was voted for */
+    if (flag > 1)
+        throw std::invalid_argument("ill-formed block");
     if (flag)
     {
         qc = hsc->parse_quorum_cert(s);
@@ -64,20 +86,89 @@ void Block::unserialize(DataStream &s, HotStuffCore *hsc) {
         auto base = s.get_data_inplace(n);
         extra = bytearray_t(base, base + n);
     }
-    this->hash = salticidae::get_hash(*this);
 }
 
-bool Block::verify(const ReplicaConfig &config) const {
-    if (qc && (!qc->verify(config) ||
-                qc->get_obj_hash() != Vote::proof_obj_hash(qc_ref_hash))) return false;
+uint64_t Block::get_short_cmd_id(const uint256_t &cmd_hash, uint64_t salt) {
+    /* splitmix64 finalizer over the (already uniform) digest */
+    uint64_t x = std::hash<uint256_t>()(cmd_hash) ^ salt;
+    x = (x ^ (x >> 30)) * 0xbf58476d1ce4e5b9ULL;
+    x = (x ^ (x >> 27)) * 0x94d049bb133111ebULL;
+    x ^= x >> 31;
+    return x & ((1ULL << (8 * short_cmd_id_size)) - 1);
+}
+
+void Block::serialize_compact(DataStream &s, uint64_t salt) const {
+    s << htole((uint32_t)parent_hashes.size());
+    for (const auto &hash: parent_hashes)
+        s << hash;
+    s << htole(salt) << htole((uint32_t)cmds.size());
+    for (const auto &cmd: cmds)
+    {
+        uint8_t id[short_cmd_id_size];
+        uint64_t x = get_short_cmd_id(cmd, salt);
+        for (size_t i = 0; i < short_cmd_id_size; i++, x >>= 8)
+            id[i] = x & 0xff;
+        s.put_data(id, id + short_cmd_id_size);
+    }
+    serialize_tail(s);
+}
+
+void Block::unserialize_compact(DataStream &s, HotStuffCore *hsc,
+                                uint64_t &salt, std::vector<uint64_t> &short_ids) {
+    uint32_t n;
+    s >> n;
+    n = letoh(n);
+    parent_hashes.resize(n);
+    for (auto &hash: parent_hashes)
+        s >> hash;
+    s >> salt >> n;
+    salt = letoh(salt);
+    n = letoh(n);
+    cmds.resize(n);
+    short_ids.resize(n);
+    for (auto &id: short_ids)
+    {
+        auto base = s.get_data_inplace(short_cmd_id_size);
+        id = 0;
+        for (size_t i = short_cmd_id_size; i--;)
+            id = (id << 8) | base[i];
+    }
+    unserialize_tail(s, hsc);
+}
+
+const Block *Block::get_ancestor(uint32_t height, uint32_t pruned_height) const {
+    if (height > this->height) return nullptr;
+    const Block *b = this;
+    while (b->height > height)
+    {
+        uint32_t hskip = get_skip_height(b->height);
+        uint32_t hskip_prev = get_skip_height(b->height - 1);
+        /* take the skip unless the parent's one gets closer to the target;
+         * the genesis block is never freed */
+        if (b->skip && (hskip > pruned_height || hskip == 0) &&
+            (hskip == height ||
+            (hskip > height && !(hskip_prev + 2 < hskip && hskip_prev >= height))))
+            b = b->skip;
+        else if (!b->parents.empty())
+            b = b->parents[0].get();
+        else
+            return nullptr;
+    }
+    return b;
+}
+
+bool Block::verify(const ReplicaConfig &config, EntityStorage &storage) const {
+    if (qc && (qc->get_obj_hash() != Vote::proof_obj_hash(qc_ref_hash) ||
+                !storage.verify_qc(*qc, config))) return false;
     return true;
 }
 
-promise_t Block::verify(const ReplicaConfig &config, VeriPool &vpool) const {
+promise_t Block::verify(const ReplicaConfig &config, VeriPool &vpool,
+                        EntityStorage &storage) const {
     return (qc ?
         (qc->get_obj_hash() != Vote::proof_obj_hash(qc_ref_hash) ?
             promise_t([](promise_t &pm) { pm.resolve(false); }) :
-            qc->verify(config, vpool)) :
+            storage.verify_qc(*qc, config, vpool)) :
     promise_t([](promise_t &pm) { pm.resolve(true); }));
 }
 
@@ -15,6 +15,8 @@
  * limitations under the License.
  */
 
+#include <chrono>
+
 #include "hotstuff/hotstuff.h"
 #include "hotstuff/client.h"
 #include "hotstuff/liveness.h"
@@ -27,6 +29,11 @@ using salticidae::static_pointer_cast;
 
 namespace hotstuff {
 
+static double get_time_sec() {
+    return std::chrono::duration<double>(
+        std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 const opcode_t MsgPropose::opcode;
 MsgPropose::MsgPropose(const Proposal &proposal) { serialized << proposal; }
 void MsgPropose::postponed_parse(HotStuffCore *hsc) {
@@ -90,12 +97,81 @@ void MsgRespBlock::postponed_parse(HotStuffCore *hsc) {
     blks.resize(size);
     for (auto &blk: blks)
     {
-        Block _blk;
-        _blk.unserialize(serialized, hsc);
-        blk = hsc->storage->add_blk(std::move(_blk), hsc->get_config());
+        block_t _blk = new Block();
+        _blk->unserialize(serialized, hsc);
+        blk = hsc->storage->add_blk(_blk);
+    }
+}
+
+const opcode_t MsgProposeCompact::opcode;
+MsgProposeCompact::MsgProposeCompact(const Proposal &proposal, uint64_t salt) {
+    serialized << proposal.proposer << proposal.blk->get_hash();
+    proposal.blk->serialize_compact(serialized, salt);
+}
+
+void MsgProposeCompact::postponed_parse(HotStuffCore *hsc) {
+    serialized >> proposer >> blk_hash;
+    blk.unserialize_compact(serialized, hsc, salt, short_ids);
+}
+
+const opcode_t MsgReqCmds::opcode;
+MsgReqCmds::MsgReqCmds(const uint256_t &blk_hash, const std::vector<uint32_t> &idx) {
+    serialized << blk_hash << htole((uint32_t)idx.size());
+    for (auto i: idx)
+        serialized << htole(i);
+}
+
+MsgReqCmds::MsgReqCmds(DataStream &&s) {
+    uint32_t size;
+    s >> blk_hash >> size;
+    size = letoh(size);
+    idx.resize(size);
+    for (auto &i: idx)
+    {
+        s >> i;
+        i = letoh(i);
     }
 }
 
+const opcode_t MsgRespCmds::opcode;
+MsgRespCmds::MsgRespCmds(const uint256_t &blk_hash,
+                        const std::vector<uint32_t> &idx,
+                        const std::vector<uint256_t> &cmds) {
+    serialized << blk_hash << htole((uint32_t)idx.size());
+    for (size_t i = 0; i < idx.size(); i++)
+        serialized << htole(idx[i]) << cmds[i];
+}
+
+MsgRespCmds::MsgRespCmds(DataStream &&s) {
+    uint32_t size;
+    s >> blk_hash >> size;
+    size = letoh(size);
+    idx.resize(size);
+    cmds.resize(size);
+    for (size_t i = 0; i < size; i++)
+    {
+        s >> idx[i] >> cmds[i];
+        idx[i] = letoh(idx[i]);
+    }
+}
+
+const opcode_t MsgVoteBundle::opcode;
+MsgVoteBundle::MsgVoteBundle(const VoteBundle &bundle) { serialized << bundle; }
+void MsgVoteBundle::postponed_parse(HotStuffCore *hsc) {
+    bundle.hsc = hsc;
+    serialized >> bundle;
+}
+
+const opcode_t MsgVoteEcho::opcode;
+MsgVoteEcho::MsgVoteEcho(ReplicaID voter, const uint256_t &blk_hash, uint32_t height) {
+    serialized << voter << blk_hash << htole(height);
+}
+
+MsgVoteEcho::MsgVoteEcho(DataStream &&s) {
+    s >> voter >> blk_hash >> height;
+    height = letoh(height);
+}
+
 // TODO: improve this function
 void HotStuffBase::exec_command(uint256_t cmd_hash, commit_cb_t callback) {
     cmd_pending.enqueue(std::make_pair(cmd_hash, callback));
@@ -205,7 +281,7 @@ promise_t HotStuffBase::async_deliver_blk(const uint256_t &blk_hash,
         for (const auto &phash: blk->get_parent_hashes())
             pms.push_back(async_deliver_blk(phash, replica_id));
         if (blk != get_genesis())
-            pms.push_back(blk->verify(get_config(), vpool));
+            pms.push_back(blk->verify(get_config(), vpool, *storage));
         promise::all(pms).then([this, blk]() {
             on_deliver_blk(blk);
         });
@@ -220,27 +296,365 @@ void HotStuffBase::propose_handler(MsgPropose &&msg, const Net::conn_t &conn) {
     auto &prop = msg.proposal;
     block_t blk = prop.blk;
     if (!blk) return;
+    on_proposal(std::move(prop), peer);
+}
+
+void HotStuffBase::on_proposal(Proposal &&prop, const NetAddr &peer) {
     promise::all(std::vector<promise_t>{
-        async_deliver_blk(blk->get_hash(), peer)
+        async_deliver_blk(prop.blk->get_hash(), peer)
     }).then([this, prop = std::move(prop)]() {
         on_receive_proposal(prop);
     });
 }
 
+void HotStuffBase::propose_compact_handler(MsgProposeCompact &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    msg.postponed_parse(this);
+    const uint256_t blk_hash = msg.blk_hash;
+    part_compact++;
+    if (short_id_indexed && msg.proposer == short_id_owner)
+        short_id_nprop++;
+    block_t blk = storage->find_blk(blk_hash);
+    if (blk)
+    {
+        on_proposal(Proposal(msg.proposer, blk, this), peer);
+        return;
+    }
+    if (compact_waiting.count(blk_hash)) return;
+    bool indexed = short_id_indexed && msg.proposer == short_id_owner &&
+                    msg.salt == short_id_salt;
+    /* an honest proposer changes the salt once every salt_period proposals,
+     * so the index is only rebuilt that often, and only for the current
+     * proposer; otherwise all commands are fetched */
+    if (!indexed && msg.proposer == pmaker->get_proposer() &&
+        (!short_id_indexed || msg.proposer != short_id_owner ||
+        short_id_nprop >= salt_period))
+    {
+        rebuild_short_id_index(msg.proposer, msg.salt);
+        indexed = true;
+    }
+    CompactContext ctx{msg.proposer, std::move(msg.blk), peer, {}, !indexed};
+    for (uint32_t i = 0; i < msg.short_ids.size(); i++)
+    {
+        auto it = indexed ? short_id_index.find(msg.short_ids[i]) : short_id_index.end();
+        if (it == short_id_index.end() || !it->second)
+            ctx.missing.push_back(i);
+        else
+            ctx.blk.set_cmd(i, *it->second);
+    }
+    if (ctx.missing.empty())
+    {
+        if (on_compact_blk(blk_hash, ctx)) return;
+    }
+    else
+    {
+        part_compact_missing += ctx.missing.size();
+        send_coalesced(MsgReqCmds(blk_hash, ctx.missing), peer);
+    }
+    compact_waiting.insert(std::make_pair(blk_hash, std::move(ctx)));
+    compact_waiting_order.push(blk_hash);
+    if (compact_waiting_order.size() > compact_waiting_capacity)
+    {
+        compact_waiting.erase(compact_waiting_order.front());
+        compact_waiting_order.pop();
+    }
+}
+
+void HotStuffBase::rebuild_short_id_index(ReplicaID proposer, uint64_t salt) {
+    short_id_index.clear();
+    short_id_owner = proposer;
+    short_id_salt = salt;
+    short_id_nprop = 0;
+    short_id_indexed = true;
+    for (const auto &e: decision_waiting)
+        index_short_id(e.first);
+}
+
+void HotStuffBase::index_short_id(const uint256_t &cmd_hash) {
+    /* commands left out are simply fetched from the proposer */
+    if (!short_id_indexed || short_id_index.size() >= short_id_index_capacity)
+        return;
+    auto r = short_id_index.insert(std::make_pair(
+                Block::get_short_cmd_id(cmd_hash, short_id_salt), &cmd_hash));
+    if (!r.second) r.first->second = nullptr;
+}
+
+void HotStuffBase::unindex_short_id(const uint256_t &cmd_hash) {
+    if (!short_id_indexed) return;
+    auto it = short_id_index.find(Block::get_short_cmd_id(cmd_hash, short_id_salt));
+    /* a collision stays marked until the next rebuild */
+    if (it != short_id_index.end() && it->second == &cmd_hash)
+        short_id_index.erase(it);
+}
+
+bool HotStuffBase::on_compact_blk(const uint256_t &blk_hash, CompactContext &ctx) {
+    ctx.blk.update_hash();
+    if (ctx.blk.get_hash() != blk_hash)
+    {
+        if (ctx.full)
+        {
+            LOG_WARN("invalid compact proposal from %d", ctx.proposer);
+            return true;
+        }
+        /* some short ID matched a wrong command, so ask for all of them */
+        ctx.full = true;
+        ctx.missing.resize(ctx.blk.get_cmds().size());
+        for (uint32_t i = 0; i < ctx.missing.size(); i++)
+            ctx.missing[i] = i;
+        part_compact_missing += ctx.missing.size();
+        send_coalesced(MsgReqCmds(blk_hash, ctx.missing), ctx.peer);
+        return false;
+    }
+    block_t blk = storage->add_blk(std::move(ctx.blk), get_config());
+    on_proposal(Proposal(ctx.proposer, blk, this), ctx.peer);
+    return true;
+}
+
+void HotStuffBase::req_cmds_handler(MsgReqCmds &&msg, const Net::conn_t &conn) {
+    const NetAddr replica = conn->get_peer_addr();
+    if (replica.is_null()) return;
+    block_t blk = storage->find_blk(msg.blk_hash);
+    if (!blk) return;
+    const auto &cmds = blk->get_cmds();
+    std::vector<uint256_t> resp;
+    for (auto i: msg.idx)
+    {
+        if (i >= cmds.size()) return;
+        resp.push_back(cmds[i]);
+    }
+    pn.send_msg(MsgRespCmds(msg.blk_hash, msg.idx, resp), replica);
+}
+
+void HotStuffBase::add_to_batch(opcode_t opcode, const DataStream &s,
+                                const NetAddr &addr) {
+    auto &batch = out_batches[addr];
+    batch << opcode << htole((uint32_t)s.size());
+    batch.put_data(s.data(), s.data() + s.size());
+    part_coalesced++;
+    if (batch.size() >= coalesce_threshold)
+        flush_batch(addr);
+    else if (!flush_scheduled)
+    {
+        flush_scheduled = true;
+        flush_timer.add(0);
+    }
+}
+
+void HotStuffBase::flush_batch(const NetAddr &addr) {
+    auto it = out_batches.find(addr);
+    if (it == out_batches.end()) return;
+    pn.send_msg(MsgBatch(std::move(it->second)), addr);
+    out_batches.erase(it);
+    part_coalesced_frames++;
+}
+
+void HotStuffBase::flush_batches() {
+    for (auto &e: out_batches)
+    {
+        pn.send_msg(MsgBatch(std::move(e.second)), e.first);
+        part_coalesced_frames++;
+    }
+    out_batches.clear();
+}
+
+ReplicaID HotStuffBase::get_vote_parent(ReplicaID root) const {
+    size_t n = get_config().nreplicas;
+    /* a star once the fanout covers everyone */
+    size_t k = std::min(vote_fanout, n - 1);
+    size_t pos = get_vote_tree_pos(get_id(), root);
+    return ((pos - 1) / k + root) % n;
+}
+
+size_t HotStuffBase::get_vote_subtree_size(ReplicaID root) const {
+    size_t n = get_config().nreplicas;
+    size_t k = std::min(vote_fanout, n - 1);
+    size_t size = 0;
+    /* the subtree spans a range of consecutive positions on each level */
+    for (size_t lo = get_vote_tree_pos(get_id(), root), hi = lo; lo < n;
+            lo = lo * k + 1, hi = hi * k + k)
+        size += std::min(hi, n - 1) - lo + 1;
+    return size;
+}
+
+size_t HotStuffBase::get_vote_tree_depth(ReplicaID root) const {
+    size_t k = std::min(vote_fanout, get_config().nreplicas - 1);
+    size_t depth = 0;
+    for (size_t pos = get_vote_tree_pos(get_id(), root); pos; pos = (pos - 1) / k)
+        depth++;
+    return depth;
+}
+
+void HotStuffBase::aggregate_votes(const VoteBundle &bundle, uint32_t height) {
+    pmaker->beat_resp(pmaker->get_proposer())
+            .then([this, bundle, height](ReplicaID proposer) {
+        /* the proposer only counts them */
+        if (proposer == get_id() || height < get_exec_height()) return;
+        const uint256_t &blk_hash = bundle.blk_hash;
+        auto it = vote_agg_waiting.find(blk_hash);
+        if (it == vote_agg_waiting.end())
+        {
+            prune_vote_agg(get_exec_height());
+            it = vote_agg_waiting.emplace(blk_hash, VoteAggContext(
+                    proposer, height, VoteBundle(blk_hash, this))).first;
+            it->second.timer = TimerEvent(ec, [this, blk_hash](TimerEvent &) {
+                on_vote_agg_timeout(blk_hash);
+            });
+            it->second.timer.add(vote_agg_wait);
+        }
+        auto &ctx = it->second;
+        VoteBundle fresh(blk_hash, this);
+        for (const auto &v: bundle.votes)
+            if (ctx.voters.insert(v.first).second)
+            {
+                ctx.bundle.add(v.first, *v.second);
+                fresh.add(v.first, *v.second);
+            }
+        if (fresh.votes.empty()) return;
+        if (ctx.sent)
+            /* late votes go up on their own */
+            send_coalesced(MsgVoteBundle(fresh),
+                        get_config().get_addr(get_vote_parent(ctx.root)));
+        else if (ctx.voters.size() >= get_vote_subtree_size(ctx.root))
+            send_vote_bundle(blk_hash);
+    });
+}
+
+void HotStuffBase::send_vote_bundle(const uint256_t &blk_hash) {
+    auto &ctx = vote_agg_waiting.at(blk_hash);
+    ctx.sent = true;
+    send_coalesced(MsgVoteBundle(ctx.bundle),
+                get_config().get_addr(get_vote_parent(ctx.root)));
+    /* the votes take a round per level up the tree, and the QC relayed by
+     * the proposer one more to come back */
+    ctx.timer.del();
+    ctx.timer.add((get_vote_tree_depth(ctx.root) + 1) * vote_agg_wait);
+}
+
+void HotStuffBase::on_vote_agg_timeout(const uint256_t &blk_hash) {
+    auto it = vote_agg_waiting.find(blk_hash);
+    if (it == vote_agg_waiting.end()) return;
+    auto &ctx = it->second;
+    if (!ctx.sent)
+    {
+        LOG_DEBUG("sending %lu votes for %.10s before the subtree is done",
+                ctx.bundle.votes.size(), get_hex(blk_hash).c_str());
+        send_vote_bundle(blk_hash);
+        return;
+    }
+    /* no QC: some replica on the path to the root may be faulty */
+    if (get_vote_parent(ctx.root) == ctx.root) return;
+    LOG_WARN("no QC for %.10s, sending %lu votes to the proposer",
+            get_hex(blk_hash).c_str(), ctx.bundle.votes.size());
+    send_coalesced(MsgVoteBundle(ctx.bundle), get_config().get_addr(ctx.root));
+}
+
+void HotStuffBase::prune_vote_agg(uint32_t height) {
+    for (auto it = vote_agg_waiting.begin(); it != vote_agg_waiting.end();)
+        if (it->second.height < height)
+            it = vote_agg_waiting.erase(it);
+        else
+            it++;
+}
+
+void HotStuffBase::batch_handler(MsgBatch &&msg, const Net::conn_t &conn) {
+    auto &s = msg.serialized;
+    while (s.size())
+    {
+        opcode_t opcode;
+        uint32_t len;
+        s >> opcode >> len;
+        len = letoh(len);
+        auto base = s.get_data_inplace(len);
+        DataStream ms(base, base + len);
+        switch (opcode)
+        {
+            case MsgVote::opcode:
+                vote_handler(MsgVote(std::move(ms)), conn); break;
+            case MsgNotify::opcode:
+                notify_handler(MsgNotify(std::move(ms)), conn); break;
+            case MsgVoteBundle::opcode:
+                vote_bundle_handler(MsgVoteBundle(std::move(ms)), conn); break;
+            case MsgVoteEcho::opcode:
+                vote_echo_handler(MsgVoteEcho(std::move(ms)), conn); break;
+            case MsgBlame::opcode:
+                blame_handler(MsgBlame(std::move(ms)), conn); break;
+            case MsgBlameNotify::opcode:
+                blamenotify_handler(MsgBlameNotify(std::move(ms)), conn); break;
+            case MsgReqBlock::opcode:
+                req_blk_handler(MsgReqBlock(std::move(ms)), conn); break;
+            case MsgReqCmds::opcode:
+                req_cmds_handler(MsgReqCmds(std::move(ms)), conn); break;
+            default:
+                LOG_WARN("unexpected opcode %u in a batch", opcode);
+                return;
+        }
+    }
+}
+
+void HotStuffBase::resp_cmds_handler(MsgRespCmds &&msg, const Net::conn_t &conn) {
+    auto it = compact_waiting.find(msg.blk_hash);
+    if (it == compact_waiting.end()) return;
+    auto &ctx = it->second;
+    /* only the peer that sent the proposal was asked */
+    if (conn->get_peer_addr() != ctx.peer || msg.idx != ctx.missing) return;
+    for (size_t i = 0; i < msg.idx.size(); i++)
+        ctx.blk.set_cmd(msg.idx[i], msg.cmds[i]);
+    if (on_compact_blk(msg.blk_hash, ctx))
+        compact_waiting.erase(it);
+}
+
 void HotStuffBase::vote_handler(MsgVote &&msg, const Net::conn_t &conn) {
     const NetAddr &peer = conn->get_peer_addr();
     if (peer.is_null()) return;
     msg.postponed_parse(this);
     //auto &vote = msg.vote;
     RcObj<Vote> v(new Vote(std::move(msg.vote)));
+    double arrival = delay_est ? get_time_sec() : 0;
     promise::all(std::vector<promise_t>{
         async_deliver_blk(v->blk_hash, peer),
         v->verify(vpool),
-    }).then([this, v=std::move(v)](const promise::values_t values) {
+    }).then([this, v=std::move(v), arrival](const promise::values_t values) {
         if (!promise::any_cast<bool>(values[1]))
             LOG_WARN("invalid vote from %d", v->voter);
         else
+        {
+            if (delay_est) on_vote_delay(*v, arrival);
             on_receive_vote(*v);
+        }
+    });
+}
+
+void HotStuffBase::vote_bundle_handler(MsgVoteBundle &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    msg.postponed_parse(this);
+    RcObj<VoteBundle> b(new VoteBundle(std::move(msg.bundle)));
+    promise::all(std::vector<promise_t>{
+        async_deliver_blk(b->blk_hash, peer),
+        b->verify(vpool),
+    }).then([this, b, peer](const promise::values_t values) {
+        if (!promise::any_cast<bool>(values[1]))
+        {
+            LOG_WARN("invalid vote bundle from %s", std::string(peer).c_str());
+            return;
+        }
+        for (size_t i = 0; i < b->votes.size(); i++)
+            on_receive_vote(b->get_vote(i));
+        aggregate_votes(*b, promise::any_cast<block_t>(values[0])->get_height());
+    });
+}
+
+void HotStuffBase::vote_echo_handler(MsgVoteEcho &&msg, const Net::conn_t &conn) {
+    const NetAddr &peer = conn->get_peer_addr();
+    if (peer.is_null()) return;
+    /* nothing left to blame at the executed heights */
+    if (msg.height < get_exec_height()) return;
+    auto voter = msg.voter;
+    /* the block goes through the same checks as the one of a vote, so a
+     * conflicting one starts a blame */
+    async_deliver_blk(msg.blk_hash, peer).then([this, voter](block_t blk) {
+        on_receive_proposal(Proposal(voter, blk, nullptr));
     });
 }
 
@@ -256,7 +670,11 @@ void HotStuffBase::notify_handler(MsgNotify &&msg, const Net::conn_t &conn) {
         if (!promise::any_cast<bool>(values[1]))
             LOG_WARN("invalid notify message from %s", std::string(peer).c_str());
         else
+        {
             on_receive_notify(*n);
+            if (vote_fanout)
+                prune_vote_agg(promise::any_cast<block_t>(values[0])->get_height() + 1);
+        }
     });
 }
 
@@ -294,22 +712,46 @@ void HotStuffBase::set_commit_timer(const block_t &blk, double t_sec) {
 #ifdef SYNCHS_NOTIMER
     on_commit_timeout(blk);
 #else
-    auto height = blk->get_height();
-    auto &timer = commit_timers[height] =
-        TimerEvent(ec, [this, blk=std::move(blk), height](TimerEvent &) {
-            on_commit_timeout(blk);
-            stop_commit_timer(height);
-        });
-    timer.add(t_sec);
+    double deadline = get_time_sec() + t_sec;
+    /* deadlines only go backwards when delta shrinks */
+    auto it = commit_queue.end();
+    while (it != commit_queue.begin() && std::prev(it)->deadline > deadline)
+        it--;
+    bool earliest = it == commit_queue.begin();
+    commit_queue.insert(it, CommitEntry{deadline, blk, commit_epoch});
+    if (earliest) commit_timer.add(t_sec);
 #endif
 }
 
+void HotStuffBase::on_commit_timer() {
+    double now = get_time_sec();
+    std::vector<block_t> due;
+    while (!commit_queue.empty() && commit_queue.front().deadline <= now)
+    {
+        auto &e = commit_queue.front();
+        if (e.epoch == commit_epoch && e.blk)
+            due.push_back(std::move(e.blk));
+        commit_queue.pop_front();
+    }
+    if (!commit_queue.empty())
+        commit_timer.add(commit_queue.front().deadline - now);
+    if (!due.empty())
+        on_commit_timeout(due);
+}
+
 void HotStuffBase::stop_commit_timer(uint32_t height) {
-    commit_timers.erase(height);
+    /* the stopped heights are usually the lowest pending ones */
+    for (auto &e: commit_queue)
+        if (e.blk && e.blk->get_height() == height)
+        {
+            e.blk = nullptr;
+            break;
+        }
 }
 
 void HotStuffBase::stop_commit_timer_all() {
-    commit_timers.clear();
+    /* the stale entries are dropped as their deadlines pass */
+    commit_epoch++;
 }
 
 void HotStuffBase::set_blame_timer(double t_sec) {
@@ -376,8 +818,13 @@ void HotStuffBase::print_stat() const {
     LOG_INFO("blk_fetch_waiting: %lu", blk_fetch_waiting.size());
     LOG_INFO("blk_delivery_waiting: %lu", blk_delivery_waiting.size());
     LOG_INFO("decision_waiting: %lu", decision_waiting.size());
-    LOG_INFO("commit_timers: %lu", commit_timers.size());
+    LOG_INFO("commit_queue: %lu", commit_queue.size());
+    if (executor)
+        LOG_INFO("exec_queue: %lu (+%lu backlog)",
+                executor->get_ninflight(), exec_backlog.size());
     LOG_INFO("-------- misc ---------");
+    LOG_INFO("delta: %.3f ms (%s)", get_config().delta * 1e3,
+            delay_est ? "adaptive" : "static");
     LOG_INFO("fetched: %lu", fetched);
     LOG_INFO("delivered: %lu", delivered);
 #ifdef SYNCHS_LATBREAKDOWN
@@ -386,8 +833,12 @@ void HotStuffBase::print_stat() const {
     LOG_INFO("lat_commit: +%.3f ms",
             part_decided ? part_lat_committed / part_decided * 1e3 : 0);
 #endif
+    LOG_INFO("sig_cache: %lu hit, %lu miss",
+            verified_sig_cache.get_nhit(), verified_sig_cache.get_nmiss());
     LOG_INFO("cmd_cache: %lu", storage->get_cmd_cache_size());
-    LOG_INFO("blk_cache: %lu", storage->get_blk_cache_size());
+    LOG_INFO("blk_cache: %lu (%lu bytes), pruned below %u",
+            storage->get_blk_cache_size(), storage->get_blk_cache_bytes(),
+            get_pruned_height());
     LOG_INFO("------ misc (10s) -----");
     LOG_INFO("fetched: %lu", part_fetched);
     LOG_INFO("delivered: %lu", part_delivered);
@@ -399,6 +850,17 @@ void HotStuffBase::print_stat() const {
             part_delivered ? part_delivery_time / double(part_delivered) : 0,
             part_delivery_time_min == double_inf ? 0 : part_delivery_time_min,
             part_delivery_time_max);
+    LOG_INFO("batches: %u, avg. size %.3f, %u by deadline",
+            part_nbatch,
+            part_nbatch ? part_batch_size / double(part_nbatch) : 0,
+            part_batch_deadline);
+    LOG_INFO("block size: %lu [%lu, %lu], avg. qc latency %.3f ms",
+            blk_size, blk_size_min, blk_size_max,
+            part_nqc ? part_qc_lat / part_nqc * 1e3 : 0);
+    LOG_INFO("compact proposals: %u, %u cmds fetched",
+            part_compact, part_compact_missing);
+    LOG_INFO("coalesced: %u msgs in %u frames",
+            part_coalesced, part_coalesced_frames);
 
     part_parent_size = 0;
     part_fetched = 0;
@@ -412,6 +874,15 @@ void HotStuffBase::print_stat() const {
     part_delivery_time = 0;
     part_delivery_time_min = double_inf;
     part_delivery_time_max = 0;
+    part_nbatch = 0;
+    part_batch_size = 0;
+    part_batch_deadline = 0;
+    part_nqc = 0;
+    part_qc_lat = 0;
+    part_compact = 0;
+    part_compact_missing = 0;
+    part_coalesced = 0;
+    part_coalesced_frames = 0;
 #ifdef HOTSTUFF_MSG_STAT
     LOG_INFO("--- replica msg. (10s) ---");
     size_t _nsent = 0;
@@ -453,9 +924,34 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         HotStuffCore(rid, std::move(priv_key)),
         listen_addr(listen_addr),
         blk_size(blk_size),
+        blk_size_min(blk_size),
+        blk_size_max(blk_size),
+        batch_max_wait(0),
+        qc_lat_base(0),
+        batch_timer_armed(false),
         ec(ec),
         tcall(ec),
         vpool(ec, nworker),
+        commit_epoch(0),
+        prune_staleness(0),
+        prune_interval(0),
+        blk_cache_budget(0),
+        prune_batch(64),
+        prune_scheduled(false),
+        delay_est(nullptr),
+        ndelay_sample(0),
+        ndelay_low(0),
+        executor(nullptr),
+        b_executed(get_genesis()),
+        compact_proposal(false),
+        salt_gen(std::random_device()()),
+        salt(0), salt_uses(0),
+        short_id_owner(0), short_id_salt(0), short_id_nprop(0),
+        short_id_indexed(false),
+        coalesce_threshold(0),
+        flush_scheduled(false),
+        vote_fanout(0),
+        vote_agg_wait(0),
         pn(ec, netconfig),
         pmaker(std::move(pmaker)),
 
@@ -468,7 +964,16 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
         part_gened(0),
         part_delivery_time(0),
         part_delivery_time_min(double_inf),
-        part_delivery_time_max(0)
+        part_delivery_time_max(0),
+        part_nbatch(0),
+        part_batch_size(0),
+        part_batch_deadline(0),
+        part_nqc(0),
+        part_qc_lat(0),
+        part_compact(0),
+        part_compact_missing(0),
+        part_coalesced(0),
+        part_coalesced_frames(0)
 #ifdef SYNCHS_LATBREAKDOWN
     ,   part_lat_proposed(0),
         part_lat_committed(0)
@@ -476,19 +981,190 @@ HotStuffBase::HotStuffBase(uint32_t blk_size,
 
 {
     /* register the handlers for msg from replicas */
+    commit_timer = TimerEvent(ec, [this](TimerEvent &) { on_commit_timer(); });
+    batch_timer = TimerEvent(ec, [this](TimerEvent &) { on_batch_timer(); });
+    prune_timer = TimerEvent(ec, [this](TimerEvent &) { on_prune_tick(); });
+    flush_timer = TimerEvent(ec, [this](TimerEvent &) {
+        flush_scheduled = false;
+        flush_batches();
+    });
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::notify_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_bundle_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::vote_echo_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blame_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::blamenotify_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_blk_handler, this, _1, _2));
     pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_blk_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::propose_compact_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::req_cmds_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::resp_cmds_handler, this, _1, _2));
+    pn.reg_handler(salticidae::generic_bind(&HotStuffBase::batch_handler, this, _1, _2));
     pn.reg_conn_handler(salticidae::generic_bind(&HotStuffBase::conn_handler, this, _1, _2));
     pn.start();
     pn.listen(listen_addr);
 }
 void HotStuffBase::do_consensus(const block_t &blk) {
     pmaker->on_consensus(blk);
+    /* nothing to prune until blk is far enough above the pruned height */
+    if (blk->get_height() <= get_pruned_height() + prune_staleness) return;
+    if ((prune_interval &&
+            blk->get_height() >= get_pruned_height() + prune_staleness + prune_interval) ||
+        (blk_cache_budget && storage->get_blk_cache_bytes() > blk_cache_budget))
+        schedule_prune();
+}
+
+void HotStuffBase::set_batching(size_t blk_size_min, size_t blk_size_max,
+                                double max_wait) {
+    this->blk_size_min = std::max(blk_size_min, (size_t)1);
+    this->blk_size_max = std::max(blk_size_max, this->blk_size_min);
+    blk_size = std::min(std::max(blk_size, this->blk_size_min), this->blk_size_max);
+    batch_max_wait = max_wait;
+}
+
+void HotStuffBase::propose_batch(size_t size) {
+    std::vector<uint256_t> cmds;
+    for (size_t i = 0; i < size; i++)
+    {
+        cmds.push_back(cmd_pending_buffer.front());
+        cmd_pending_buffer.pop();
+    }
+    if (cmd_pending_buffer.empty() && batch_timer_armed)
+    {
+        batch_timer.del();
+        batch_timer_armed = false;
+    }
+    part_nbatch++;
+    part_batch_size += size;
+    pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
+        if (proposer == get_id())
+        {
+            auto blk = on_propose(cmds, pmaker->get_parents());
+#ifdef SYNCHS_LATBREAKDOWN
+            for (auto &ch: cmds)
+                cmd_lats[ch].on_propose();
+#endif
+#ifdef SYNCHS_AUTOCLI
+            for (size_t i = pmaker->get_pending_size(); i < 1; i++)
+                do_demand_commands(blk_size);
+#endif
+            if (blk && blk_size_min < blk_size_max)
+                async_qc_finish(blk).then([this, t = get_time_sec()]() {
+                    on_batch_qc(get_time_sec() - t);
+                });
+        }
+    });
+}
+
+void HotStuffBase::on_batch_timer() {
+    batch_timer_armed = false;
+    if (cmd_pending_buffer.empty()) return;
+    if (is_exec_throttled())
+    {
+        /* try again once execution catches up */
+        batch_timer.add(batch_max_wait);
+        batch_timer_armed = true;
+        return;
+    }
+    part_batch_deadline++;
+    propose_batch(std::min(cmd_pending_buffer.size(), blk_size));
+    if (!cmd_pending_buffer.empty())
+    {
+        batch_timer.add(batch_max_wait);
+        batch_timer_armed = true;
+    }
+}
+
+void HotStuffBase::on_batch_qc(double lat) {
+    part_nqc++;
+    part_qc_lat += lat;
+    qc_lat_base = qc_lat_base > 0 ? std::min(qc_lat_base, lat) : lat;
+    size_t backlog = cmd_pending_buffer.size();
+    if (lat > 2 * qc_lat_base)
+        /* larger blocks no longer pay off */
+        blk_size -= blk_size / 4;
+    else if (backlog >= blk_size)
+        blk_size += std::max(blk_size / 4, (size_t)1);
+    else if (!backlog)
+        blk_size -= std::max(blk_size / 8, (size_t)1);
+    blk_size = std::min(std::max(blk_size, blk_size_min), blk_size_max);
+}
+
+void HotStuffBase::enable_adaptive_delta(double percentile, double factor,
+                                        double dmin, double dmax, size_t window) {
+    delay_est = new DelayEstimator(window, percentile, factor, dmin, dmax);
+}
+
+void HotStuffBase::on_blk_seen(const uint256_t &blk_hash) {
+    if (!blk_seen_time.insert(std::make_pair(blk_hash, get_time_sec())).second)
+        return;
+    blk_seen_order.push(blk_hash);
+    if (blk_seen_order.size() > blk_seen_capacity)
+    {
+        blk_seen_time.erase(blk_seen_order.front());
+        blk_seen_order.pop();
+    }
+}
+
+void HotStuffBase::on_vote_delay(const Vote &vote, double arrival) {
+    auto it = blk_seen_time.find(vote.blk_hash);
+    if (it == blk_seen_time.end() || arrival < it->second) return;
+    double delay = arrival - it->second;
+    delay_est->add(vote.voter, delay);
+    double cur = get_config().delta;
+    double delta;
+    if (delay_est->bound(delay) > cur)
+    {
+        /* a slower round trip than allowed for: catch up right away */
+        delta = delay_est->bound(delay);
+        ndelay_low = 0;
+    }
+    else
+    {
+        if (++ndelay_sample % delta_update_period) return;
+        delta = delay_est->get();
+        if (delta >= cur)
+        {
+            ndelay_low = 0;
+            return;
+        }
+        /* only lower it once the network stayed faster for a whole window */
+        ndelay_low += delta_update_period;
+        if (ndelay_low < delay_est->get_window()) return;
+        ndelay_low = 0;
+    }
+    if (delta == cur) return;
+    LOG_DEBUG("delta: %.3f ms -> %.3f ms", cur * 1e3, delta * 1e3);
+    set_delta(delta);
+}
+
+void HotStuffBase::set_prune_policy(uint32_t staleness, uint32_t interval,
+                                    size_t blk_cache_budget, size_t batch) {
+    prune_staleness = staleness;
+    prune_interval = interval;
+    this->blk_cache_budget = blk_cache_budget;
+    prune_batch = std::max(batch, (size_t)1);
+}
+
+void HotStuffBase::schedule_prune() {
+    if (prune_scheduled) return;
+    prune_scheduled = true;
+    prune_timer.add(0);
+}
+
+void HotStuffBase::on_prune_tick() {
+    prune_scheduled = false;
+    /* do_consensus() runs before b_exec is updated, so the pruning starts
+     * here rather than there */
+    if (!is_pruning() &&
+        !prune_begin(prune_staleness, executor ? b_executed : nullptr)) return;
+    if (prune_step(prune_batch))
+        schedule_prune();
+    else
+        LOG_DEBUG("pruned below height %u, blk_cache: %lu (%lu bytes)",
+                get_pruned_height(), storage->get_blk_cache_size(),
+                storage->get_blk_cache_bytes());
 }
 
 void HotStuffBase::do_decide(Finality &&fin) {
@@ -498,15 +1174,73 @@ void HotStuffBase::do_decide(Finality &&fin) {
     if (it != decision_waiting.end())
     {
         it->second(std::move(fin));
+        unindex_short_id(it->first);
         decision_waiting.erase(it);
     }
 }
 
+void HotStuffBase::enable_executor(size_t capacity) {
+    executor = new Executor<block_t>(ec, std::max(capacity, (size_t)1),
+        [this](const block_t &blk) {
+            state_machine_execute_block(blk, blk->get_cmds());
+        },
+        [this](block_t &&blk) { on_exec_done(std::move(blk)); });
+}
+
+void HotStuffBase::do_decide_block(const block_t &blk) {
+    part_decided += blk->get_cmds().size();
+    if (executor)
+    {
+        /* keep the commit order behind the blocks already waiting */
+        if (!exec_backlog.empty() || !executor->submit(blk))
+            exec_backlog.push(blk);
+        return;
+    }
+    state_machine_execute_block(blk, blk->get_cmds());
+    on_decide_block_done(blk);
+}
+
+void HotStuffBase::on_exec_done(block_t &&blk) {
+    b_executed = blk;
+    on_decide_block_done(blk);
+    while (!exec_backlog.empty() && executor->submit(exec_backlog.front()))
+        exec_backlog.pop();
+    if (!is_exec_throttled() && cmd_pending_buffer.size() >= blk_size &&
+        pmaker->get_proposer() == get_id())
+        propose_batch(blk_size);
+}
+
+void HotStuffBase::on_decide_block_done(const block_t &blk) {
+    const auto &cmds = blk->get_cmds();
+    if (!decision_waiting.empty())
+        for (size_t i = 0; i < cmds.size(); i++)
+        {
+            auto it = decision_waiting.find(cmds[i]);
+            if (it == decision_waiting.end()) continue;
+            it->second(Finality(get_id(), 1, i, blk->get_height(),
+                                cmds[i], blk->get_hash()));
+            unindex_short_id(it->first);
+            decision_waiting.erase(it);
+        }
+    on_decide_block(blk);
+}
+
+void HotStuffBase::state_machine_execute_block(const block_t &blk,
+                                            const std::vector<uint256_t> &cmds) {
+    for (size_t i = 0; i < cmds.size(); i++)
+        state_machine_execute(Finality(get_id(), 1, i, blk->get_height(),
+                                        cmds[i], blk->get_hash()));
+}
+
+void HotStuffBase::do_broadcast_qc(const Notify &notify) {
+    _do_broadcast<Notify, MsgNotify>(notify);
+}
+
 void HotStuffBase::do_notify(const Notify &notify) {
     MsgNotify m(notify);
     ReplicaID next_proposer = pmaker->get_proposer();
     if (next_proposer != get_id())
-        pn.send_msg(m, get_config().get_addr(next_proposer));
+        send_coalesced(m, get_config().get_addr(next_proposer));
     else
         on_receive_notify(notify);
 }
@@ -548,6 +1282,7 @@ void HotStuffBase::start(
             if (it == decision_waiting.end())
             {
                 it = decision_waiting.insert(std::make_pair(cmd_hash, e.second)).first;
+                index_short_id(it->first);
 #ifdef SYNCHS_LATBREAKDOWN
                 cmd_lats[cmd_hash].on_init();
 #endif
@@ -556,30 +1291,16 @@ void HotStuffBase::start(
                 e.second(Finality(id, 0, 0, 0, cmd_hash, uint256_t()));
             if (proposer != get_id()) continue;
             cmd_pending_buffer.push(cmd_hash);
-            if (cmd_pending_buffer.size() >= blk_size)
+            if (cmd_pending_buffer.size() >= blk_size && !is_exec_throttled())
             {
-                std::vector<uint256_t> cmds;
-                for (uint32_t i = 0; i < blk_size; i++)
-                {
-                    cmds.push_back(cmd_pending_buffer.front());
-                    cmd_pending_buffer.pop();
-                }
-                pmaker->beat().then([this, cmds = std::move(cmds)](ReplicaID proposer) {
-                    if (proposer == get_id())
-                    {
-                        on_propose(cmds, pmaker->get_parents());
-#ifdef SYNCHS_LATBREAKDOWN
-                        for (auto &ch: cmds)
-                            cmd_lats[ch].on_propose();
-#endif
-#ifdef SYNCHS_AUTOCLI
-                        for (size_t i = pmaker->get_pending_size(); i < 1; i++)
-                            do_demand_commands(blk_size);
-#endif
-                    }
-                });
+                propose_batch(blk_size);
                 return true;
             }
+            if (batch_max_wait > 0 && !batch_timer_armed)
+            {
+                batch_timer.add(batch_max_wait);
+                batch_timer_armed = true;
+            }
 #ifdef SYNCHS_LATBREAKDOWN
             auto orig_cb = std::move(it.second);
             it.second = [this](Finality &fin) {
@@ -31,8 +31,11 @@ int main(int argc, char **argv) {
     config.add_opt("algo", opt_algo, Config::SET_VAL);
     config.parse(argc, argv);
     auto &algo = opt_algo->get();
-    if (algo == "secp256k1")
+    /* the aggregated scheme uses the same secp256k1 key pairs */
+    if (algo == "secp256k1" || algo == "secp256k1-halfagg")
         priv_key = new hotstuff::PrivKeySecp256k1();
+    else if (algo == "ed25519")
+        priv_key = new hotstuff::PrivKeyEd25519();
     else
         error(1, 0, "algo not supported");
     int n = opt_n->get();
@@ -0,0 +1,321 @@
+/**
+ * Copyright 2018 VMware
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *     http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+/* Microbenchmarks for the crypto backends: signing, verification,
+ * (de)serialization of certificates and VeriPool throughput, for a range of
+ * replica counts and worker counts. Results are printed as CSV or JSON. */
+
+#include <error.h>
+#include <algorithm>
+#include <chrono>
+#include <thread>
+#include "salticidae/util.h"
+#include "hotstuff/entity.h"
+#include "hotstuff/crypto.h"
+
+using salticidae::Config;
+using salticidae::EventContext;
+using salticidae::NetAddr;
+using namespace hotstuff;
+
+using timepoint_t = std::chrono::steady_clock::time_point;
+
+static double elapsed_sec(const timepoint_t &since) {
+    return std::chrono::duration<double>(
+            std::chrono::steady_clock::now() - since).count();
+}
+
+struct Result {
+    std::string backend;
+    std::string op;
+    size_t n;
+    size_t nworker;
+    size_t count;
+    double ops_per_sec;
+    double p50_us, p90_us, p99_us;
+};
+
+class Report {
+    std::vector<Result> results;
+
+    public:
+    /** Record `count` operations that took `total` seconds overall, with the
+     * latency of each operation (or batch) in `lats`. */
+    void add(const std::string &backend, const std::string &op,
+            size_t n, size_t nworker, size_t count, double total,
+            std::vector<double> lats) {
+        std::sort(lats.begin(), lats.end());
+        auto pct = [&lats](double p) {
+            if (lats.empty()) return 0.0;
+            return lats[std::min(lats.size() - 1, (size_t)(p * lats.size()))] * 1e6;
+        };
+        results.push_back(Result{backend, op, n, nworker, count,
+                                total > 0 ? count / total : 0,
+                                pct(0.5), pct(0.9), pct(0.99)});
+        fprintf(stderr, "%s %s n=%lu nworker=%lu: %.1f ops/s\n",
+                backend.c_str(), op.c_str(), n, nworker, results.back().ops_per_sec);
+    }
+
+    void print_csv() const {
+        printf("backend,op,n,nworker,count,ops_per_sec,p50_us,p90_us,p99_us\n");
+        for (const auto &r: results)
+            printf("%s,%s,%lu,%lu,%lu,%.1f,%.2f,%.2f,%.2f\n",
+                r.backend.c_str(), r.op.c_str(), r.n, r.nworker, r.count,
+                r.ops_per_sec, r.p50_us, r.p90_us, r.p99_us);
+    }
+
+    void print_json() const {
+        printf("[\n");
+        for (size_t i = 0; i < results.size(); i++)
+        {
+            const auto &r = results[i];
+            printf("  {\"backend\": \"%s\", \"op\": \"%s\", \"n\": %lu, "
+                    "\"nworker\": %lu, \"count\": %lu, \"ops_per_sec\": %.1f, "
+                    "\"p50_us\": %.2f, \"p90_us\": %.2f, \"p99_us\": %.2f}%s\n",
+                r.backend.c_str(), r.op.c_str(), r.n, r.nworker, r.count,
+                r.ops_per_sec, r.p50_us, r.p90_us, r.p99_us,
+                i + 1 < results.size() ? "," : "");
+        }
+        printf("]\n");
+    }
+};
+
+/* Every signature is made over a fresh message, so that no measurement is
+ * served by verified_sig_cache unless stated otherwise. */
+static uint256_t gen_msg() {
+    static uint64_t cnt = 0;
+    DataStream s;
+    s << cnt++;
+    return s.get_hash();
+}
+
+/* Run `op` `count` times, recording the latency of each run. */
+template<typename Func>
+static void measure(Report &report, const std::string &backend,
+                    const std::string &op, size_t n, size_t count, Func &&f) {
+    std::vector<double> lats;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        auto t = std::chrono::steady_clock::now();
+        f(i);
+        lats.push_back(elapsed_sec(t));
+    }
+    report.add(backend, op, n, 1, count, elapsed_sec(t0), std::move(lats));
+}
+
+/* Dispatch `ec` until all the promises created by `submit` are resolved. */
+template<typename Func>
+static void run_pool(Report &report, const std::string &backend,
+                    const std::string &op, size_t n, size_t nworker,
+                    size_t count, Func &&submit) {
+    EventContext ec;
+    VeriPool vpool(ec, nworker);
+    std::vector<double> lats(count);
+    size_t ndone = 0;
+    bool ok = true;
+    auto t0 = std::chrono::steady_clock::now();
+    for (size_t i = 0; i < count; i++)
+    {
+        auto t = std::chrono::steady_clock::now();
+        submit(i, vpool).then([&, i, t](bool result) {
+            lats[i] = elapsed_sec(t);
+            ok &= result;
+            if (++ndone == count) ec.stop();
+        });
+    }
+    if (ndone < count) ec.dispatch();
+    if (!ok) error(1, 0, "%s: %s failed to verify", backend.c_str(), op.c_str());
+    report.add(backend, op, n, nworker, count, elapsed_sec(t0), std::move(lats));
+}
+
+template<typename PrivKeyType, typename PartCertType, typename QuorumCertType>
+class Bench {
+    std::string backend;
+    Report &report;
+    size_t niter;
+
+    public:
+    Bench(const std::string &backend, Report &report, size_t niter):
+        backend(backend), report(report), niter(niter) {}
+
+    void run_single() {
+        PrivKeyType priv_key;
+        priv_key.from_rand();
+        pubkey_bt pub_key = priv_key.get_pubkey();
+        std::vector<uint256_t> msgs;
+        for (size_t i = 0; i < niter; i++)
+            msgs.push_back(gen_msg());
+        std::vector<BoxObj<PartCertType>> certs(niter);
+        measure(report, backend, "sign", 1, niter, [&](size_t i) {
+            certs[i] = new PartCertType(priv_key, msgs[i]);
+        });
+        std::vector<DataStream> streams(niter);
+        measure(report, backend, "part_cert_serialize", 1, niter, [&](size_t i) {
+            streams[i] << *certs[i];
+        });
+        std::vector<PartCertType> parsed(niter);
+        measure(report, backend, "part_cert_parse", 1, niter, [&](size_t i) {
+            streams[i] >> parsed[i];
+        });
+        measure(report, backend, "verify", 1, niter, [&](size_t i) {
+            if (!parsed[i].verify(*pub_key))
+                error(1, 0, "%s: invalid signature", backend.c_str());
+        });
+        measure(report, backend, "verify_cached", 1, niter, [&](size_t i) {
+            parsed[i].verify(*pub_key);
+        });
+    }
+
+    void run_quorum(size_t n, const std::vector<size_t> &nworkers) {
+        ReplicaConfig config;
+        std::vector<BoxObj<PrivKeyType>> priv_keys;
+        for (size_t i = 0; i < n; i++)
+        {
+            priv_keys.push_back(new PrivKeyType());
+            priv_keys.back()->from_rand();
+            config.add_replica(i, ReplicaInfo(i, NetAddr(), priv_keys.back()->get_pubkey()));
+        }
+        config.nmajority = n / 2 + 1;
+        /* sign everything upfront, one certificate per iteration */
+        auto make_parts = [&]() {
+            std::vector<std::pair<uint256_t, std::vector<BoxObj<PartCertType>>>> parts;
+            for (size_t i = 0; i < niter; i++)
+            {
+                auto msg = gen_msg();
+                std::vector<BoxObj<PartCertType>> p;
+                for (size_t j = 0; j < config.nmajority; j++)
+                    p.push_back(new PartCertType(*priv_keys[j], msg));
+                parts.push_back(std::make_pair(msg, std::move(p)));
+            }
+            return parts;
+        };
+        auto parts = make_parts();
+        std::vector<BoxObj<QuorumCertType>> qcs(niter);
+        for (size_t i = 0; i < niter; i++)
+            qcs[i] = new QuorumCertType(config, parts[i].first);
+        measure(report, backend, "qc_add_part", n, niter, [&](size_t i) {
+            for (size_t j = 0; j < config.nmajority; j++)
+                qcs[i]->add_part(j, *parts[i].second[j]);
+        });
+        measure(report, backend, "qc_compute", n, niter, [&](size_t i) {
+            qcs[i]->compute();
+        });
+        std::vector<DataStream> streams(niter);
+        measure(report, backend, "qc_serialize", n, niter, [&](size_t i) {
+            streams[i] << *qcs[i];
+        });
+        std::vector<QuorumCertType> parsed(niter);
+        measure(report, backend, "qc_parse", n, niter, [&](size_t i) {
+            streams[i] >> parsed[i];
+        });
+        measure(report, backend, "qc_verify", n, niter, [&](size_t i) {
+            if (!parsed[i].verify(config))
+                error(1, 0, "%s: invalid quorum certificate", backend.c_str());
+        });
+        measure(report, backend, "qc_verify_cached", n, niter, [&](size_t i) {
+            parsed[i].verify(config);
+        });
+        for (auto nworker: nworkers)
+        {
+            /* fresh signatures for each run, to keep the cache out */
+            auto parts = make_parts();
+            std::vector<BoxObj<QuorumCertType>> qcs;
+            for (auto &p: parts)
+            {
+                qcs.push_back(new QuorumCertType(config, p.first));
+                for (size_t j = 0; j < config.nmajority; j++)
+                    qcs.back()->add_part(j, *p.second[j]);
+                qcs.back()->compute();
+            }
+            run_pool(report, backend, "qc_verify_pool", n, nworker, niter,
+                [&](size_t i, VeriPool &vpool) {
+                    return qcs[i]->verify(config, vpool);
+                });
+            std::vector<std::pair<ReplicaID, BoxObj<PartCertType>>> votes;
+            for (auto &p: make_parts())
+                for (size_t j = 0; j < config.nmajority; j++)
+                    votes.push_back(std::make_pair(j, std::move(p.second[j])));
+            run_pool(report, backend, "verify_pool", n, nworker, votes.size(),
+                [&](size_t i, VeriPool &vpool) {
+                    return votes[i].second->verify(
+                        config.get_pubkey(votes[i].first), vpool);
+                });
+        }
+    }
+};
+
+template<typename PrivKeyType, typename PartCertType, typename QuorumCertType>
+static void run_backend(const std::string &backend, Report &report, size_t niter,
+                        const std::vector<size_t> &ns,
+                        const std::vector<size_t> &nworkers) {
+    Bench<PrivKeyType, PartCertType, QuorumCertType> bench(backend, report, niter);
+    bench.run_single();
+    for (auto n: ns)
+        bench.run_quorum(n, nworkers);
+}
+
+int main(int argc, char **argv) {
+    Config config("hotstuff.conf");
+    auto opt_backend = Config::OptValStr::create("all");
+    auto opt_nmin = Config::OptValInt::create(4);
+    auto opt_nmax = Config::OptValInt::create(128);
+    auto opt_nworker = Config::OptValInt::create(std::thread::hardware_concurrency());
+    auto opt_niter = Config::OptValInt::create(100);
+    auto opt_format = Config::OptValStr::create("csv");
+    auto opt_help = Config::OptValFlag::create(false);
+    config.add_opt("backend", opt_backend, Config::SET_VAL, 'b', "backend to run (secp256k1, secp256k1-halfagg, ed25519, all)");
+    config.add_opt("nmin", opt_nmin, Config::SET_VAL, 'n', "the smallest number of replicas (doubled up to nmax)");
+    config.add_opt("nmax", opt_nmax, Config::SET_VAL, 'N', "the largest number of replicas");
+    config.add_opt("nworker", opt_nworker, Config::SET_VAL, 'w', "the largest number of verification threads (doubled from 1)");
+    config.add_opt("iter", opt_niter, Config::SET_VAL, 'i', "the number of iterations per measurement");
+    config.add_opt("format", opt_format, Config::SET_VAL, 'f', "output format (csv, json)");
+    config.add_opt("help", opt_help, Config::SWITCH_ON, 'h', "show this help info");
+    config.parse(argc, argv);
+    if (opt_help->get())
+    {
+        config.print_help();
+        return 0;
+    }
+    if (opt_nmin->get() < 1 || opt_nmax->get() < opt_nmin->get() ||
+        opt_nworker->get() < 1 || opt_niter->get() < 1)
+        error(1, 0, "invalid parameters");
+    std::vector<size_t> ns, nworkers;
+    for (size_t n = opt_nmin->get(); n <= (size_t)opt_nmax->get(); n <<= 1)
+        ns.push_back(n);
+    for (size_t w = 1; w < (size_t)opt_nworker->get(); w <<= 1)
+        nworkers.push_back(w);
+    nworkers.push_back(opt_nworker->get());
+    size_t niter = opt_niter->get();
+
+    Report report;
+    const auto &backend = opt_backend->get();
+    bool all = backend == "all";
+    if (all || backend == "secp256k1")
+        run_backend<PrivKeySecp256k1, PartCertSecp256k1, QuorumCertSecp256k1>(
+            "secp256k1", report, niter, ns, nworkers);
+    if (all || backend == "secp256k1-halfagg")
+        run_backend<PrivKeySecp256k1, PartCertSchnorrSecp256k1, QuorumCertHalfAggSecp256k1>(
+            "secp256k1-halfagg", report, niter, ns, nworkers);
+    if (all || backend == "ed25519")
+        run_backend<PrivKeyEd25519, PartCertEd25519, QuorumCertEd25519>(
+            "ed25519", report, niter, ns, nworkers);
+    if (opt_format->get() == "json")
+        report.print_json();
+    else
+        report.print_csv();
+    return 0;
+}
@@ -16,7 +16,7 @@ int main() {
     sig.sign(bytearray_t(32), p);
     printf("%s\n", get_hex(sig).c_str());
     s << sig;
-    SigSecp256k1 sig2(secp256k1_default_verify_ctx);
+    SigSecp256k1 sig2;
     s >> sig2;
     bytearray_t msg = bytearray_t(32);
     msg[0] = 1;